@@ -0,0 +1,898 @@
+// Headless driver: runs the physics only, with no window or GL context, so
+// large simulations can run on machines without a GPU.
+//
+//   nbody_batch --bodies 100000 --ic plummer --steps 1000 --dt 0.01 --solver bh --out run/frame --every 100
+//
+// Every --every steps (and after the last one) the particles are written to
+// <out>_<step>.csv as id,x,y,z,vx,vy,vz,m.
+//
+// With --checkpoint the whole state is saved every --checkpoint-every steps
+// and at the end; rerunning the same command with --restart on that file
+// carries on from there up to --steps.
+//
+// With --export every body goes to <export>_<step>.nbc (or .h5 with
+// --export-format h5) as columns, see column_export.h.
+//
+// With --trajectory the positions at the start and every --trajectory-every
+// steps go into one compressed trajectory file (see trajectory.h).
+//
+// Output is written on a separate thread from copies of the bodies, with at
+// most --io-queue copies waiting, so writing does not slow stepping down.
+//
+// --verify-trajectory and --verify-export write a file from the initial
+// bodies, read it back and compare, then exit: 0 if everything matched.
+#include "checkpoint.h"
+#include "column_export.h"
+#include "initial_conditions.h"
+#include "profiler.h"
+#include "simulation.h"
+#include "snapshot_writer.h"
+#include "thread_pool.h"
+#include "trajectory.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct BatchOptions
+{
+    int bodies = 10000;
+    std::string ic = "shell";
+    // 0 takes the model's default size; a negative mass gives 5 per body
+    float scale = 0.0f;
+    float mass = -1.0f;
+    int steps = 100;
+    float dt = 0.01f;
+    std::string solver = "bh";
+    Integrator integrator = Integrator::Leapfrog;
+    // solver options in the order given, for GravitySolver::SetOption
+    std::vector<std::pair<std::string, float>> solver_options;
+    int threads = 0;
+    uint64_t seed = 1;
+    std::string out;
+    int every = 0;
+    int energy = 0;
+    std::string profile;
+    std::string checkpoint;
+    int checkpoint_every = 0;
+    std::string restart;
+    std::string trajectory;
+    int trajectory_every = 1;
+    TrajectoryOptions trajectory_options;
+    std::string export_prefix;
+    int export_every = 0;
+    std::string export_format = "nbc";
+    int export_threads = 4;
+    int io_queue = 2;
+    std::string verify_trajectory;
+    std::string verify_export;
+};
+
+// what a frame given to the snapshot writer is for
+const unsigned int OUTPUT_SNAPSHOT = 1;
+const unsigned int OUTPUT_CHECKPOINT = 2;
+const unsigned int OUTPUT_TRAJECTORY = 4;
+const unsigned int OUTPUT_EXPORT = 8;
+
+static void PrintUsage()
+{
+    std::cout
+        << "usage: nbody_batch [options]\n"
+        << "  --bodies N      number of bodies (default 10000)\n"
+        << "  --ic MODEL      initial conditions (default shell), one of:\n";
+
+    for (const InitialConditionsInfo& info : InitialConditionsModels())
+    {
+        std::cout << "                    " << info.name << ": " << info.description << "\n";
+    }
+
+    std::cout
+        << "  --scale S       size of the initial conditions (default: the model's)\n"
+        << "  --mass M        total mass (default 5 per body)\n"
+        << "  --steps N       step to run up to (default 100)\n"
+        << "  --dt T          fixed timestep (default 0.01)\n"
+        << "  --solver S      force calculation (default bh), one of:\n";
+
+    for (const GravitySolverInfo& info : GravitySolvers())
+    {
+        std::cout << "                    " << info.name << ": " << info.description << "\n";
+    }
+
+    std::cout
+        << "  --integrator I  leapfrog, dkd, euler or block (default leapfrog);\n"
+        << "                  with block, --dt is the longest step\n"
+        << "  --group N       bodies sharing one tree walk, 0 = one walk per\n"
+        << "                  body (default 32)\n"
+        << "  --theta T       opening angle (default 0.7, 0.5 for fmm)\n"
+        << "  --monopole      leave the quadrupoles out of the tree walk\n"
+        << "  --leaf N        bodies an octree leaf holds before it splits\n"
+        << "                  (default 8)\n"
+        << "  --order N       fmm expansion order, 1-8 (default 4)\n"
+        << "  --option K=V    sets solver option K, for options without a flag\n"
+        << "  --threads N     worker threads, 0 = all cores (default 0)\n"
+        << "  --seed N        seed for the initial conditions (default 1)\n"
+        << "  --out PREFIX    write <PREFIX>_<step>.csv snapshots\n"
+        << "  --every N       snapshot interval in steps (default: last step only)\n"
+        << "  --energy N      print the total energy every N steps (default: never)\n"
+        << "  --profile FILE  write per-step timings to FILE (.json or .csv);\n"
+        << "                  needs a build with NBODY_PROFILE\n"
+        << "  --checkpoint F  save the state to F at the end of the run\n"
+        << "  --checkpoint-every N\n"
+        << "                  also save it every N steps (default: never)\n"
+        << "  --restart F     start from checkpoint F instead of new bodies;\n"
+        << "                  --bodies, --ic, --scale, --mass and --seed are\n"
+        << "                  ignored\n"
+        << "  --trajectory F  write positions to the compressed trajectory F\n"
+        << "  --trajectory-every N\n"
+        << "                  trajectory interval in steps (default 1)\n"
+        << "  --trajectory-bits B\n"
+        << "                  grid bits per axis, 4-24 (default 16)\n"
+        << "  --keyframe-every N\n"
+        << "                  trajectory frames per keyframe (default 32)\n"
+        << "  --export PREFIX write <PREFIX>_<step>.<format> column files with\n"
+        << "                  id, position, velocity, mass, acceleration and\n"
+        << "                  potential; the potential costs one more force\n"
+        << "                  evaluation per export\n"
+        << "  --export-every N\n"
+        << "                  export interval in steps (default: last step only)\n"
+        << "  --export-format F\n"
+        << "                  nbc (native, default) or h5"
+        << (ColumnExportHasHdf5() ? "" : " (not in this build)") << "\n"
+        << "  --export-threads N\n"
+        << "                  threads writing export chunks (default 4)\n"
+        << "  --io-queue N    copies of the bodies waiting to be written before\n"
+        << "                  stepping waits for the disk; 0 writes on the\n"
+        << "                  stepping thread (default 2)\n"
+        << "  --verify-trajectory F\n"
+        << "                  write 3.5 keyframes' worth of steps to the\n"
+        << "                  trajectory F, read them back out of order, check\n"
+        << "                  them against the bodies and exit\n"
+        << "  --verify-export F\n"
+        << "                  export the initial bodies to the native column\n"
+        << "                  file F in small chunks, read id, position and\n"
+        << "                  potential back, check them and exit\n";
+}
+
+static bool ParseOptions(int argc, char* argv[], BatchOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--help" || arg == "-h")
+        {
+            return false;
+        }
+
+        if (arg == "--monopole")
+        {
+            options.solver_options.push_back(std::make_pair(std::string("quadrupole"), 0.0f));
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::cerr << "missing value for " << arg << std::endl;
+            return false;
+        }
+
+        const char* value = argv[++i];
+
+        if (arg == "--bodies")
+        {
+            options.bodies = std::atoi(value);
+        }
+        else if (arg == "--ic")
+        {
+            options.ic = value;
+        }
+        else if (arg == "--scale")
+        {
+            options.scale = static_cast<float>(std::atof(value));
+        }
+        else if (arg == "--mass")
+        {
+            options.mass = static_cast<float>(std::atof(value));
+        }
+        else if (arg == "--steps")
+        {
+            options.steps = std::atoi(value);
+        }
+        else if (arg == "--dt")
+        {
+            options.dt = static_cast<float>(std::atof(value));
+        }
+        else if (arg == "--solver")
+        {
+            options.solver = value;
+        }
+        else if (arg == "--integrator")
+        {
+            if (std::strcmp(value, "leapfrog") == 0)
+            {
+                options.integrator = Integrator::Leapfrog;
+            }
+            else if (std::strcmp(value, "dkd") == 0)
+            {
+                options.integrator = Integrator::LeapfrogDKD;
+            }
+            else if (std::strcmp(value, "euler") == 0)
+            {
+                options.integrator = Integrator::Euler;
+            }
+            else if (std::strcmp(value, "block") == 0)
+            {
+                options.integrator = Integrator::Block;
+            }
+            else
+            {
+                std::cerr << "unknown integrator " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--group" || arg == "--theta" || arg == "--leaf" || arg == "--order")
+        {
+            options.solver_options.push_back(std::make_pair(arg.substr(2), static_cast<float>(std::atof(value))));
+        }
+        else if (arg == "--option")
+        {
+            const char* equals = std::strchr(value, '=');
+            if (!equals)
+            {
+                std::cerr << "--option wants NAME=VALUE, got " << value << std::endl;
+                return false;
+            }
+            options.solver_options.push_back(std::make_pair(std::string(value, equals),
+                static_cast<float>(std::atof(equals + 1))));
+        }
+        else if (arg == "--threads")
+        {
+            options.threads = std::atoi(value);
+        }
+        else if (arg == "--seed")
+        {
+            options.seed = std::strtoull(value, nullptr, 10);
+        }
+        else if (arg == "--out")
+        {
+            options.out = value;
+        }
+        else if (arg == "--every")
+        {
+            options.every = std::atoi(value);
+        }
+        else if (arg == "--energy")
+        {
+            options.energy = std::atoi(value);
+        }
+        else if (arg == "--profile")
+        {
+            options.profile = value;
+        }
+        else if (arg == "--checkpoint")
+        {
+            options.checkpoint = value;
+        }
+        else if (arg == "--checkpoint-every")
+        {
+            options.checkpoint_every = std::atoi(value);
+        }
+        else if (arg == "--restart")
+        {
+            options.restart = value;
+        }
+        else if (arg == "--trajectory")
+        {
+            options.trajectory = value;
+        }
+        else if (arg == "--trajectory-every")
+        {
+            options.trajectory_every = std::max(1, std::atoi(value));
+        }
+        else if (arg == "--trajectory-bits")
+        {
+            options.trajectory_options.bits = std::atoi(value);
+        }
+        else if (arg == "--keyframe-every")
+        {
+            options.trajectory_options.keyframe_every = std::atoi(value);
+        }
+        else if (arg == "--export")
+        {
+            options.export_prefix = value;
+        }
+        else if (arg == "--export-every")
+        {
+            options.export_every = std::atoi(value);
+        }
+        else if (arg == "--export-format")
+        {
+            options.export_format = value;
+            if (options.export_format != "nbc" && options.export_format != "h5")
+            {
+                std::cerr << "unknown export format " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--export-threads")
+        {
+            options.export_threads = std::max(1, std::atoi(value));
+        }
+        else if (arg == "--io-queue")
+        {
+            options.io_queue = std::max(0, std::atoi(value));
+        }
+        else if (arg == "--verify-trajectory")
+        {
+            options.verify_trajectory = value;
+        }
+        else if (arg == "--verify-export")
+        {
+            options.verify_export = value;
+        }
+        else
+        {
+            std::cerr << "unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    return options.bodies > 0 && options.steps >= 0;
+}
+
+static bool WriteSnapshot(const ParticleSet& particles, const std::string& prefix, int step)
+{
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), "_%06d.csv", step);
+    std::string path = prefix + suffix;
+
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file)
+    {
+        std::cerr << "cannot open " << path << std::endl;
+        return false;
+    }
+
+    std::fprintf(file, "id,x,y,z,vx,vy,vz,m\n");
+    for (size_t i = 0; i < particles.Size(); ++i)
+    {
+        std::fprintf(file, "%u,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", particles.id[i],
+            particles.x[i], particles.y[i], particles.z[i],
+            particles.vx[i], particles.vy[i], particles.vz[i], particles.m[i]);
+    }
+
+    std::fclose(file);
+    return true;
+}
+
+// fills scratch with the acceleration and potential of every body, the
+// potential last
+static void EvaluatePotential(Simulation& sim, AlignedVector<float> (&scratch)[4])
+{
+    for (AlignedVector<float>& column : scratch)
+    {
+        column.resize(sim.Particles.Size());
+    }
+
+    sim.EvaluateForces(AccelOut{ scratch[0].data(), scratch[1].data(), scratch[2].data(), scratch[3].data() });
+}
+
+// prints the energy after a step and its drift from initial, returns the total
+static double PrintEnergy(Simulation& sim, int step, double initial)
+{
+    EnergyReport energy = sim.Energy();
+
+    std::cout << "step " << step << ": kinetic " << energy.kinetic << ", potential " << energy.potential
+        << ", total " << energy.total;
+    if (initial != 0.0)
+    {
+        std::cout << " (drift " << (energy.total - initial) / std::abs(initial) << ")";
+    }
+    std::cout << std::endl;
+
+    return energy.total;
+}
+
+// Steps the bodies through three and a half keyframe intervals, writing
+// every step to a trajectory at path and keeping the positions by id, then
+// reads the frames back in shuffled order, which seeks backwards and
+// across keyframes, and once more in order, which decodes incrementally.
+// Every id must come back once and every position within half a grid step.
+static bool VerifyTrajectory(Simulation& sim, const BatchOptions& options, const std::string& path)
+{
+    const ParticleSet& particles = sim.Particles;
+    const int keyframe_every = std::max(1, options.trajectory_options.keyframe_every);
+    const int frame_count = 3 * keyframe_every + keyframe_every / 2 + 1;
+
+    size_t id_limit = 0;
+    for (size_t i = 0; i < particles.Size(); ++i)
+    {
+        id_limit = std::max(id_limit, static_cast<size_t>(particles.id[i]) + 1);
+    }
+
+    std::vector<glm::vec3> expected(frame_count * id_limit);
+
+    TrajectoryWriter writer;
+    std::string error;
+    if (!writer.Open(path, options.trajectory_options, error))
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
+
+    for (int f = 0; f < frame_count; ++f)
+    {
+        if (f > 0)
+        {
+            sim.Step(options.dt);
+        }
+
+        for (size_t i = 0; i < particles.Size(); ++i)
+        {
+            expected[f * id_limit + particles.id[i]] = particles.Position(i);
+        }
+
+        if (!writer.Append(particles, f, f * static_cast<double>(options.dt), error))
+        {
+            std::cerr << error << std::endl;
+            return false;
+        }
+    }
+
+    if (!writer.Close(error))
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
+
+    TrajectoryReader reader;
+    if (!reader.Open(path, error))
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
+
+    if (reader.FrameCount() != static_cast<size_t>(frame_count))
+    {
+        std::cerr << path << ": wrote " << frame_count << " frames, read " << reader.FrameCount() << std::endl;
+        return false;
+    }
+
+    std::vector<size_t> visits(frame_count);
+    for (int f = 0; f < frame_count; ++f)
+    {
+        visits[f] = f;
+    }
+    std::shuffle(visits.begin(), visits.end(), std::mt19937_64(options.seed));
+    for (int f = 0; f < frame_count; ++f)
+    {
+        visits.push_back(f);
+    }
+
+    const float levels = static_cast<float>((1u << reader.Bits()) - 1);
+    TrajectoryFrame frame;
+    std::vector<char> seen(id_limit);
+    double worst = 0.0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t index : visits)
+    {
+        const TrajectoryFrameInfo& info = reader.Frame(index);
+
+        if (reader.FindStep(info.step) != index || !reader.Read(index, frame, error))
+        {
+            std::cerr << (error.empty() ? path + ": cannot find step " + std::to_string(info.step) : error) << std::endl;
+            return false;
+        }
+
+        if (frame.step != index || frame.id.size() != particles.Size())
+        {
+            std::cerr << path << ": frame " << index << " came back as step " << frame.step
+                << " with " << frame.id.size() << " bodies" << std::endl;
+            return false;
+        }
+
+        std::fill(seen.begin(), seen.end(), 0);
+
+        for (size_t k = 0; k < frame.id.size(); ++k)
+        {
+            const uint32_t id = frame.id[k];
+            if (id >= id_limit || seen[id])
+            {
+                std::cerr << path << ": frame " << index << " has id " << id << " out of place" << std::endl;
+                return false;
+            }
+            seen[id] = 1;
+
+            const glm::vec3& want = expected[index * id_limit + id];
+            const float got[3] = { frame.x[k], frame.y[k], frame.z[k] };
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                // half a grid step, and a few ulps of the box and of the
+                // coordinate for encoding and decoding in float
+                const float range = info.box_max[axis] - info.box_min[axis];
+                const float cell = range / levels;
+                const float error_allowed = 0.5f * cell + 4.0f * FLT_EPSILON * (range + std::abs(want[axis]));
+                const float off = std::abs(got[axis] - want[axis]);
+
+                if (!(off <= error_allowed))
+                {
+                    std::cerr << path << ": frame " << index << " id " << id << " is " << off
+                        << " off on axis " << axis << ", more than " << error_allowed << std::endl;
+                    return false;
+                }
+                worst = std::max(worst, static_cast<double>(off / cell));
+            }
+        }
+    }
+
+    double read_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    long long keyframes = writer.KeyframesWritten();
+    std::cout << "trajectory " << path << ": " << frame_count << " frames, " << keyframes << " keyframes, "
+        << writer.BytesWritten() << " bytes; " << visits.size() << " reads in " << read_ms
+        << " ms, worst error " << worst << " grid steps" << std::endl;
+    return true;
+}
+
+// Exports the bodies with their potential to the native column file at
+// path, in chunks of an eighth of them so the reader has several to put
+// together, and checks id, position and potential against the bodies.
+static bool VerifyExport(Simulation& sim, const std::string& path)
+{
+    const ParticleSet& particles = sim.Particles;
+    const size_t n = particles.Size();
+
+    AlignedVector<float> forces[4];
+    EvaluatePotential(sim, forces);
+
+    ColumnExportOptions export_options;
+    export_options.chunk_rows = std::max<size_t>(1, n / 8);
+
+    std::string error;
+    if (!ExportColumns(path, particles, ColumnExportFrame{ 0, 0.0, forces[3].data() }, export_options, sim.Pool(), error))
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
+
+    ColumnFile file;
+    if (!file.Open(path, error))
+    {
+        std::cerr << error << (ColumnExportHasHdf5() ? " (only native files can be checked)" : "") << std::endl;
+        return false;
+    }
+
+    const ColumnDescriptor* position = file.Find("position");
+    if (file.Header().count != n || !position || position->chunk_count < 2)
+    {
+        std::cerr << path << ": expected " << n << " bodies in several chunks" << std::endl;
+        return false;
+    }
+
+    std::vector<uint32_t> ids;
+    std::vector<float> positions;
+    std::vector<float> potential;
+    std::vector<float> wrong_type;
+
+    if (!file.Read("id", ids, error) || !file.Read("position", positions, error) || !file.Read("potential", potential, error))
+    {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    if (file.Read("id", wrong_type, error))
+    {
+        std::cerr << path << ": id read back as float" << std::endl;
+        return false;
+    }
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        bool same = ids[i] == particles.id[i] &&
+            positions[3 * i] == particles.x[i] && positions[3 * i + 1] == particles.y[i] && positions[3 * i + 2] == particles.z[i] &&
+            potential[i] == forces[3][i];
+        mismatches += same ? 0 : 1;
+    }
+
+    if (mismatches > 0)
+    {
+        std::cerr << path << ": " << mismatches << " of " << n << " bodies differ" << std::endl;
+        return false;
+    }
+
+    std::cout << "export " << path << ": " << n << " bodies in " << position->chunk_count
+        << " chunks per column read back unchanged" << std::endl;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    BatchOptions options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    Simulation sim(options.threads);
+    sim.Scheme = options.integrator;
+
+    if (!sim.SetSolver(options.solver))
+    {
+        std::cerr << "unknown solver " << options.solver << std::endl;
+        PrintUsage();
+        return 1;
+    }
+
+    for (const std::pair<std::string, float>& option : options.solver_options)
+    {
+        if (!sim.Gravity().SetOption(option.first, option.second))
+        {
+            std::cerr << "solver " << options.solver << " has no option " << option.first << std::endl;
+            return 1;
+        }
+    }
+
+    CheckpointInfo resumed{ 0, 0.0 };
+
+    if (!options.restart.empty())
+    {
+        auto load_start = std::chrono::steady_clock::now();
+
+        std::string error;
+        if (!ReadCheckpoint(options.restart, sim.Particles, resumed, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+
+        double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start).count();
+        std::cout << "restarted from " << options.restart << " at step " << resumed.step
+            << " in " << load_ms << " ms" << std::endl;
+    }
+    else
+    {
+        InitialConditionsOptions ic;
+        ic.count = options.bodies;
+        ic.seed = options.seed;
+        ic.total_mass = options.mass >= 0.0f ? options.mass : 5.0f * options.bodies;
+        ic.scale = options.scale;
+
+        auto ic_start = std::chrono::steady_clock::now();
+
+        if (!GenerateInitialConditions(options.ic, sim.Particles, ic, sim.Pool()))
+        {
+            std::cerr << "unknown initial conditions " << options.ic << std::endl;
+            return 1;
+        }
+
+        double ic_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - ic_start).count();
+        std::cout << options.ic << " initial conditions in " << ic_ms << " ms" << std::endl;
+    }
+
+    if (!options.verify_export.empty() || !options.verify_trajectory.empty())
+    {
+        bool ok = true;
+
+        // the export first, while the bodies are where they started
+        if (!options.verify_export.empty())
+        {
+            ok = VerifyExport(sim, options.verify_export) && ok;
+        }
+        if (!options.verify_trajectory.empty())
+        {
+            ok = VerifyTrajectory(sim, options, options.verify_trajectory) && ok;
+        }
+
+        return ok ? 0 : 1;
+    }
+
+    const int first_step = static_cast<int>(resumed.step);
+    const int steps = std::max(0, options.steps - first_step);
+
+    std::cout << sim.Particles.Size() << " bodies, " << steps << " steps, "
+        << sim.ThreadCount() << " threads" << std::endl;
+
+    double initial_energy = 0.0;
+    if (options.energy > 0)
+    {
+        initial_energy = PrintEnergy(sim, first_step, 0.0);
+    }
+
+    // acceleration and potential from the extra force evaluation for exports
+    AlignedVector<float> export_scratch[4];
+
+    // only touched by the writer thread until it is flushed
+    TrajectoryWriter trajectory;
+    if (!options.trajectory.empty())
+    {
+        std::string error;
+        if (!trajectory.Open(options.trajectory, options.trajectory_options, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+
+    // the simulation's pool is busy stepping while exports are written
+    std::unique_ptr<ThreadPool> export_pool;
+    if (!options.export_prefix.empty())
+    {
+        export_pool.reset(new ThreadPool(options.export_threads));
+    }
+
+    SnapshotWriter writer([&](const ParticleSet& particles, const float* potential, long long step, double time, unsigned int tag)
+    {
+        bool ok = true;
+
+        if (tag & OUTPUT_SNAPSHOT)
+        {
+            ok = WriteSnapshot(particles, options.out, static_cast<int>(step));
+        }
+
+        if (tag & OUTPUT_CHECKPOINT)
+        {
+            std::string error;
+            if (!WriteCheckpoint(options.checkpoint, particles, CheckpointInfo{ static_cast<uint64_t>(step), time }, error))
+            {
+                std::cerr << error << std::endl;
+                ok = false;
+            }
+        }
+
+        if (tag & OUTPUT_EXPORT)
+        {
+            char suffix[32];
+            std::snprintf(suffix, sizeof(suffix), "_%06lld.", step);
+
+            std::string error;
+            if (!ExportColumns(options.export_prefix + suffix + options.export_format, particles,
+                ColumnExportFrame{ step, time, potential }, ColumnExportOptions(), export_pool.get(), error))
+            {
+                std::cerr << error << std::endl;
+                ok = false;
+            }
+        }
+
+        if (tag & OUTPUT_TRAJECTORY)
+        {
+            std::string error;
+            if (!trajectory.Append(particles, step, time, error))
+            {
+                std::cerr << error << std::endl;
+                ok = false;
+            }
+        }
+
+        return ok;
+    }, options.io_queue);
+
+    if (!options.trajectory.empty())
+    {
+        writer.Submit(sim.Particles, first_step, resumed.time, OUTPUT_TRAJECTORY);
+    }
+
+#ifdef NBODY_PROFILE
+    // the whole run goes to --profile, so no step may be dropped
+    Profiler::SetCapacity(0);
+#endif
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int step = first_step + 1; step <= options.steps; ++step)
+    {
+        sim.Step(options.dt);
+
+        bool last = step == options.steps;
+        bool due = options.every > 0 && step % options.every == 0;
+
+        unsigned int output = 0;
+        if (!options.out.empty() && (last || due))
+        {
+            output |= OUTPUT_SNAPSHOT;
+        }
+        if (!options.checkpoint.empty() && (last || (options.checkpoint_every > 0 && step % options.checkpoint_every == 0)))
+        {
+            output |= OUTPUT_CHECKPOINT;
+        }
+        if (!options.trajectory.empty() && step % options.trajectory_every == 0)
+        {
+            output |= OUTPUT_TRAJECTORY;
+        }
+        if (!options.export_prefix.empty() && (last || (options.export_every > 0 && step % options.export_every == 0)))
+        {
+            output |= OUTPUT_EXPORT;
+        }
+
+        if (output)
+        {
+            double time = resumed.time + (step - first_step) * static_cast<double>(options.dt);
+
+            // the step leaves no potential behind, so exports evaluate the
+            // forces once more to get it
+            const float* potential = nullptr;
+            if (output & OUTPUT_EXPORT)
+            {
+                EvaluatePotential(sim, export_scratch);
+                potential = export_scratch[3].data();
+            }
+
+            writer.Submit(sim.Particles, step, time, output, potential);
+        }
+
+        if (options.energy > 0 && (step % options.energy == 0 || last))
+        {
+            PrintEnergy(sim, step, initial_energy);
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "done in " << seconds << " s, "
+        << (seconds > 0.0 ? steps / seconds : 0.0) << " steps/s" << std::endl;
+
+    writer.Flush();
+
+    SnapshotWriterStats io = writer.Stats();
+    if (io.submitted > 0)
+    {
+        std::cout << "output: " << io.written << " of " << io.submitted << " frames written, "
+            << io.copy_seconds * 1000.0 << " ms copying and " << io.wait_seconds * 1000.0
+            << " ms waiting on the step thread, " << io.write_seconds * 1000.0 << " ms writing, at most "
+            << io.max_queued << " queued" << std::endl;
+    }
+
+    if (!options.trajectory.empty())
+    {
+        double raw = static_cast<double>(trajectory.FramesWritten()) * sim.Particles.Size() * 3 * sizeof(float);
+
+        std::cout << "trajectory: " << trajectory.FramesWritten() << " frames, " << trajectory.KeyframesWritten()
+            << " keyframes, " << trajectory.BytesWritten() / 1048576.0 << " MB, "
+            << (raw > 0.0 ? trajectory.BytesWritten() / raw * 100.0 : 0.0) << "% of float32 xyz" << std::endl;
+
+        std::string error;
+        if (!trajectory.Close(error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+
+    if (io.failed > 0)
+    {
+        return 1;
+    }
+
+    if (!options.profile.empty())
+    {
+#ifdef NBODY_PROFILE
+        const std::string& path = options.profile;
+        bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+
+        if (!(json ? Profiler::WriteJson(path) : Profiler::WriteCsv(path)))
+        {
+            std::cerr << "cannot write " << path << std::endl;
+            return 1;
+        }
+#else
+        std::cerr << "--profile ignored: built without NBODY_PROFILE" << std::endl;
+#endif
+    }
+
+    return 0;
+}
@@ -0,0 +1,522 @@
+// Microbenchmarks for the physics core (Google Benchmark).
+//
+// Arguments are {bodies, distribution} or {bodies, distribution, theta * 100}.
+// Besides wall time every benchmark reports time/body (time per body per
+// step) and, where it applies, interactions/s.
+#include "bhtree.h"
+#include "direct_kernel.h"
+#include "gravity.h"
+#include "gravity_solver.h"
+#include "initial_conditions.h"
+#include "instance_packing.h"
+#include "particle_set.h"
+#include "simulation.h"
+#include "thread_pool.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+enum Distribution
+{
+    UNIFORM_SHELL,
+    PLUMMER,
+    CLUSTERED_DISK
+};
+
+const float PI = 3.14159265f;
+
+static glm::vec3 RandomDirection(std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    float z = 2.0f * uniform(rng) - 1.0f;
+    float phi = 2.0f * PI * uniform(rng);
+    float s = std::sqrt(1.0f - z * z);
+
+    return glm::vec3(s * std::cos(phi), s * std::sin(phi), z);
+}
+
+// Fills a particle set with a fixed seed, so every run sees the same bodies.
+static void MakeBodies(ParticleSet& particles, int count, int distribution)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    particles.Clear();
+
+    std::vector<glm::vec3> clumps;
+    if (distribution == CLUSTERED_DISK)
+    {
+        // clump centres follow an exponential disk with a 300 unit scale length
+        for (int c = 0; c < 64; ++c)
+        {
+            float r = -300.0f * std::log(1.0f - 0.999f * uniform(rng));
+            float phi = 2.0f * PI * uniform(rng);
+            clumps.push_back(glm::vec3(r * std::cos(phi), r * std::sin(phi), 10.0f * normal(rng)));
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 position;
+
+        switch (distribution)
+        {
+        case PLUMMER:
+        {
+            // inverse of the Plummer cumulative mass profile, scale radius 100
+            float u = 0.001f + 0.998f * uniform(rng);
+            float r = 100.0f / std::sqrt(std::pow(u, -2.0f / 3.0f) - 1.0f);
+            position = RandomDirection(rng) * r;
+            break;
+        }
+        case CLUSTERED_DISK:
+        {
+            const glm::vec3& centre = clumps[i % clumps.size()];
+            position = centre + glm::vec3(normal(rng), normal(rng), 0.2f * normal(rng)) * 20.0f;
+            break;
+        }
+        default:
+            // what Game::Init does: glm::sphericalRand(1000.0f)
+            position = RandomDirection(rng) * 1000.0f;
+            break;
+        }
+
+        particles.Add(position, glm::vec3(0.0f, 0.0f, 0.0f), 5.0f);
+    }
+}
+
+static Oct RootCell(const ParticleSet& particles)
+{
+    float extent = 0.0f;
+    for (size_t i = 0; i < particles.Size(); ++i)
+    {
+        extent = std::max({ extent, std::abs(particles.x[i]), std::abs(particles.y[i]), std::abs(particles.z[i]) });
+    }
+    return Oct{ glm::vec3(0.0f, 0.0f, 0.0f), 2.0f * (extent + 69.0f) };
+}
+
+static void SetPerBodyCounters(benchmark::State& state, int bodies)
+{
+    state.counters["time/body"] = benchmark::Counter(static_cast<double>(bodies),
+        benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+    state.counters["bodies"] = bodies;
+}
+
+static ThreadPool& Pool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+static void BM_TreeBuildInsert(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    MakeBodies(particles, n, static_cast<int>(state.range(1)));
+
+    Oct root = RootCell(particles);
+    BHTree tree;
+
+    for (auto _ : state)
+    {
+        tree.Reset(root);
+        for (int i = 0; i < n; ++i)
+        {
+            tree.Insert(particles, i);
+        }
+        benchmark::DoNotOptimize(tree.nodes.data());
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["nodes"] = static_cast<double>(tree.nodes.size());
+}
+
+static void BM_TreeBuildMorton(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    MakeBodies(particles, n, static_cast<int>(state.range(1)));
+
+    Oct root = RootCell(particles);
+    BHTree tree;
+
+    for (auto _ : state)
+    {
+        tree.BuildMorton(root, particles, nullptr);
+        benchmark::DoNotOptimize(tree.nodes.data());
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["nodes"] = static_cast<double>(tree.nodes.size());
+}
+
+static void BM_TreeBuildMortonParallel(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    MakeBodies(particles, n, static_cast<int>(state.range(1)));
+
+    Oct root = RootCell(particles);
+    BHTree tree;
+
+    for (auto _ : state)
+    {
+        tree.BuildMorton(root, particles, &Pool());
+        benchmark::DoNotOptimize(tree.nodes.data());
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["threads"] = Pool().ThreadCount();
+}
+
+static void BM_ForceWalk(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    MakeBodies(particles, n, static_cast<int>(state.range(1)));
+
+    BHTree tree;
+    tree.theta = static_cast<float>(state.range(2)) / 100.0f;
+    tree.BuildMorton(RootCell(particles), particles, &Pool());
+
+    std::vector<long long> interactions(Pool().ThreadCount());
+    long long total = 0;
+
+    for (auto _ : state)
+    {
+        std::fill(interactions.begin(), interactions.end(), 0);
+
+        Pool().ParallelFor(n, 64, [&](int begin, int end, int thread)
+        {
+            long long count = 0;
+            for (int i = begin; i < end; ++i)
+            {
+                int b = tree.order[i];
+                WalkCount walk = tree.Evaluate(particles, particles.Position(b), b, particles.Acceleration(), b);
+                count += walk.nodes + walk.bodies;
+            }
+            interactions[thread] += count;
+        });
+
+        for (long long count : interactions)
+        {
+            total += count;
+        }
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["interactions/s"] = benchmark::Counter(static_cast<double>(total), benchmark::Counter::kIsRate);
+    state.counters["interactions/body"] = static_cast<double>(total) / (static_cast<double>(n) * state.iterations());
+}
+
+// Same walk as BM_ForceWalk, with groups of up to 32 bodies sharing one
+// interaction list that the direct kernel sums for all of them.
+static void BM_ForceWalkGrouped(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    MakeBodies(particles, n, static_cast<int>(state.range(1)));
+
+    BHTree tree;
+    tree.theta = static_cast<float>(state.range(2)) / 100.0f;
+    tree.BuildMorton(RootCell(particles), particles, &Pool());
+
+    std::vector<int> groups;
+    tree.FindGroups(32, groups);
+
+    std::vector<GroupScratch> scratch(Pool().ThreadCount());
+    std::vector<long long> interactions(Pool().ThreadCount());
+    long long total = 0;
+
+    for (auto _ : state)
+    {
+        std::fill(interactions.begin(), interactions.end(), 0);
+
+        Pool().ParallelFor(static_cast<int>(groups.size()), 1, [&](int begin, int end, int thread)
+        {
+            long long count = 0;
+            for (int g = begin; g < end; ++g)
+            {
+                WalkCount walk = tree.EvaluateGroup(particles, groups[g], particles.Acceleration(), scratch[thread]);
+                count += walk.nodes + walk.bodies;
+            }
+            interactions[thread] += count;
+        });
+
+        for (long long count : interactions)
+        {
+            total += count;
+        }
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["groups"] = static_cast<double>(groups.size());
+    state.counters["interactions/s"] = benchmark::Counter(static_cast<double>(total), benchmark::Counter::kIsRate);
+    state.counters["interactions/body"] = static_cast<double>(total) / (static_cast<double>(n) * state.iterations());
+}
+
+// Force error against direct summation, with monopoles only (range(1) 0)
+// or with quadrupoles (1), at opening angle range(0) / 100. Compares
+// throughput at equal error across the two.
+static void BM_ForceMultipoleError(benchmark::State& state)
+{
+    const int n = 20000;
+    ParticleSet particles;
+    MakeBodies(particles, n, PLUMMER);
+
+    BarnesHutGravity tree(&Pool());
+    tree.SetOption("theta", static_cast<float>(state.range(0)) / 100.0f);
+    tree.SetOption("quadrupole", static_cast<float>(state.range(1)));
+
+    AlignedVector<float> ex(n), ey(n), ez(n), ax(n), ay(n), az(n);
+    DirectGravity(&Pool()).ComputeAccelerations(particles, AccelOut{ ex.data(), ey.data(), ez.data(), nullptr });
+
+    for (auto _ : state)
+    {
+        tree.ComputeAccelerations(particles, AccelOut{ ax.data(), ay.data(), az.data(), nullptr });
+    }
+
+    double error = 0.0;
+    for (int i = 0; i < n; ++i)
+    {
+        glm::vec3 exact(ex[i], ey[i], ez[i]);
+        error += glm::length(glm::vec3(ax[i], ay[i], az[i]) - exact) / glm::length(exact);
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["mean_error"] = error / n;
+}
+
+// FMM force and potential error against direct summation at expansion
+// order range(0) and theta range(1) / 100, on the same bodies as
+// BM_ForceMultipoleError so the two can be compared at equal error.
+static void BM_FmmError(benchmark::State& state)
+{
+    const int n = 20000;
+    ParticleSet particles;
+    MakeBodies(particles, n, PLUMMER);
+
+    FmmGravity fmm(&Pool());
+    fmm.SetOption("order", static_cast<float>(state.range(0)));
+    fmm.SetOption("theta", static_cast<float>(state.range(1)) / 100.0f);
+
+    AlignedVector<float> ex(n), ey(n), ez(n), ephi(n), ax(n), ay(n), az(n), phi(n);
+    DirectGravity(&Pool()).ComputeAccelerations(particles, AccelOut{ ex.data(), ey.data(), ez.data(), ephi.data() });
+
+    for (auto _ : state)
+    {
+        fmm.ComputeAccelerations(particles, AccelOut{ ax.data(), ay.data(), az.data(), phi.data() });
+    }
+
+    double error = 0.0;
+    double potential_error = 0.0;
+    for (int i = 0; i < n; ++i)
+    {
+        glm::vec3 exact(ex[i], ey[i], ez[i]);
+        error += glm::length(glm::vec3(ax[i], ay[i], az[i]) - exact) / glm::length(exact);
+        potential_error += std::abs(phi[i] - ephi[i]) / std::abs(ephi[i]);
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["mean_error"] = error / n;
+    state.counters["potential_error"] = potential_error / n;
+}
+
+static void BM_BruteForce(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    MakeBodies(particles, n, static_cast<int>(state.range(1)));
+
+    const int sources = static_cast<int>(particles.PaddedSize());
+
+    for (auto _ : state)
+    {
+        Pool().ParallelFor(n, 64, [&](int begin, int end, int)
+        {
+            DirectSum(particles.x.data(), particles.y.data(), particles.z.data(), particles.m.data(), sources,
+                particles.x.data(), particles.y.data(), particles.z.data(), begin, end,
+                particles.Acceleration(), G_CONST, SOFTENING2);
+        });
+        benchmark::ClobberMemory();
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["interactions/s"] = benchmark::Counter(static_cast<double>(n) * n,
+        benchmark::Counter::kIsIterationInvariantRate);
+    state.SetLabel(SimdLevelName(DetectSimdLevel()));
+}
+
+static void BM_Drift(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    MakeBodies(particles, n, static_cast<int>(state.range(1)));
+
+    for (auto _ : state)
+    {
+        particles.Drift(0.01f);
+        benchmark::ClobberMemory();
+    }
+
+    SetPerBodyCounters(state, n);
+}
+
+static void BM_PackInstances(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    MakeBodies(particles, n, static_cast<int>(state.range(1)));
+    std::vector<float> instances(static_cast<size_t>(n) * INSTANCE_STRIDE);
+
+    for (auto _ : state)
+    {
+        PackInstances(particles, instances.data());
+        benchmark::ClobberMemory();
+    }
+
+    SetPerBodyCounters(state, n);
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(instances.size() * sizeof(float)));
+}
+
+// A whole step with the named solver from the registry, with its default
+// options, so every backend is measured on the same footing.
+static void BM_Step(benchmark::State& state, const char* solver)
+{
+    const int n = static_cast<int>(state.range(0));
+    Simulation sim;
+    sim.SetSolver(solver);
+    MakeBodies(sim.Particles, n, static_cast<int>(state.range(1)));
+
+    for (auto _ : state)
+    {
+        sim.Step(0.01f);
+    }
+
+    SetPerBodyCounters(state, n);
+}
+
+// A whole Barnes-Hut step with leaves holding up to state.range(2) bodies:
+// fewer, fuller leaves trade tree size for direct sums.
+static void BM_StepLeafCapacity(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    Simulation sim;
+    BarnesHutGravity* tree = new BarnesHutGravity(sim.Pool());
+    tree->SetOption("leaf", static_cast<float>(state.range(2)));
+    sim.SetSolver(std::unique_ptr<GravitySolver>(tree), "bh");
+    MakeBodies(sim.Particles, n, static_cast<int>(state.range(1)));
+
+    for (auto _ : state)
+    {
+        sim.Step(0.01f);
+    }
+
+    SetPerBodyCounters(state, n);
+    state.counters["nodes"] = static_cast<double>(tree->tree.nodes.size());
+    state.counters["depth"] = tree->tree.Depth();
+}
+
+static void BM_StepBlockTimesteps(benchmark::State& state)
+{
+    const int n = static_cast<int>(state.range(0));
+    Simulation sim;
+    sim.Scheme = Integrator::Block;
+    MakeBodies(sim.Particles, n, static_cast<int>(state.range(1)));
+
+    // the first step computes every force to pick the bins, so leave it out
+    sim.Step(1.0f);
+    long long updates = sim.ForceUpdates();
+
+    for (auto _ : state)
+    {
+        sim.Step(1.0f);
+    }
+
+    // a global step as short as the deepest bin would update n bodies per substep
+    SetPerBodyCounters(state, n);
+    state.counters["force_updates/step"] = benchmark::Counter(static_cast<double>(sim.ForceUpdates() - updates),
+        benchmark::Counter::kAvgIterations);
+}
+
+static void BM_InitialConditions(benchmark::State& state, const char* model)
+{
+    const int n = static_cast<int>(state.range(0));
+    ParticleSet particles;
+    InitialConditionsOptions options;
+    options.count = n;
+
+    for (auto _ : state)
+    {
+        GenerateInitialConditions(model, particles, options, &Pool());
+        benchmark::DoNotOptimize(particles.x.data());
+    }
+
+    SetPerBodyCounters(state, n);
+}
+
+static void BodiesAndDistributions(benchmark::internal::Benchmark* b, int max_bodies)
+{
+    for (int distribution : { UNIFORM_SHELL, PLUMMER, CLUSTERED_DISK })
+    {
+        for (int n = 1000; n <= max_bodies; n *= 10)
+        {
+            b->Args({ n, distribution });
+        }
+    }
+}
+
+static void WithLeafCapacities(benchmark::internal::Benchmark* b)
+{
+    for (int distribution : { UNIFORM_SHELL, PLUMMER, CLUSTERED_DISK })
+    {
+        for (int capacity : { 1, 4, 8, 16, 32 })
+        {
+            b->Args({ 100000, distribution, capacity });
+        }
+    }
+}
+
+static void WithOpeningAngles(benchmark::internal::Benchmark* b)
+{
+    for (int distribution : { UNIFORM_SHELL, PLUMMER, CLUSTERED_DISK })
+    {
+        for (int n = 1000; n <= 1000000; n *= 10)
+        {
+            for (int theta : { 30, 50, 70, 100 })
+            {
+                b->Args({ n, distribution, theta });
+            }
+        }
+    }
+}
+
+BENCHMARK(BM_TreeBuildInsert)->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 1000000); })->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_TreeBuildMorton)->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 1000000); })->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_TreeBuildMortonParallel)->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 1000000); })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_ForceWalk)->Apply(WithOpeningAngles)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_ForceWalkGrouped)->Apply(WithOpeningAngles)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_ForceMultipoleError)->ArgsProduct({ { 30, 50, 70, 100 }, { 0, 1 } })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_FmmError)->ArgsProduct({ { 2, 3, 4, 5, 6 }, { 40, 50, 60, 70 } })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_BruteForce)->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 100000); })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_Drift)->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 1000000); })->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_PackInstances)->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 1000000); })->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(BM_Step, direct, "direct")->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 100000); })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_Step, bh, "bh")->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 1000000); })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_Step, fmm, "fmm")->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 1000000); })->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_StepLeafCapacity)->Apply(WithLeafCapacities)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_StepBlockTimesteps)->Apply([](benchmark::internal::Benchmark* b) { BodiesAndDistributions(b, 10000); })->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_CAPTURE(BM_InitialConditions, shell, "shell")->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_InitialConditions, plummer, "plummer")->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_InitialConditions, hernquist, "hernquist")->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_InitialConditions, disk, "disk")->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_InitialConditions, collision, "collision")->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -1,29 +1,42 @@
 #include "bhtree.h"
 
-#include "body.h"
+#include "direct_kernel.h"
+#include "gravity.h"
+#include "morton.h"
+#include "particle_set.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
 
 #include <iostream>
 
-const float G_CONST = 6.67e-3;
-const float E_CONST = 1e-20;
-const float THRESHOLD = 0.5;
+// with quadrupoles this gives about the error that 0.5 gave with monopoles
+const float THRESHOLD = 0.7f;
 
 const int MAX_DEPTH = 40;
 
-const bool Oct::Contains(Body* b)
+const int LEAF_CAPACITY = 8;
+
+// below this many bodies a parallel build is not worth the extra copying
+const int PARALLEL_BUILD_MIN = 4096;
+// depth at which the Morton build hands subtrees out to worker threads
+const int PARALLEL_SPLIT_DEPTH = 3;
+
+const bool Oct::Contains(glm::vec3 p)
 {
     return (
-        abs(b->Position.x - center.x) < (length / 2.0f) &&
-        abs(b->Position.y - center.y) < (length / 2.0f) &&
-        abs(b->Position.z - center.z) < (length / 2.0f)
+        abs(p.x - center.x) < (length / 2.0f) &&
+        abs(p.y - center.y) < (length / 2.0f) &&
+        abs(p.z - center.z) < (length / 2.0f)
         );
 }
 
-const int Oct::GetSubtree(Body* b)
+const int Oct::GetSubtree(glm::vec3 p)
 {
     int x, y, z;
 
-    if (b->Position.x > center.x)
+    if (p.x > center.x)
     {
         x = 1;
     }
@@ -32,7 +45,7 @@ const int Oct::GetSubtree(Body* b)
         x = 0;
     }
 
-    if (b->Position.y > center.y)
+    if (p.y > center.y)
     {
         y = 1;
     }
@@ -41,7 +54,7 @@ const int Oct::GetSubtree(Body* b)
         y = 0;
     }
 
-    if (b->Position.z > center.z)
+    if (p.z > center.z)
     {
         z = 1;
     }
@@ -53,146 +66,718 @@ const int Oct::GetSubtree(Body* b)
     return (x << 0) + (y << 1) + (z << 2);
 }
 
-BHTree::BHTree(Oct o)
-    : oct(o)
-    , is_external(false)
-    , contains_body(false)
-    , mass(0.0f)
-    , center_of_mass(glm::vec3(0, 0, 0))
+Oct Oct::GetChild(int i) const
+{
+    Oct o{ center, length / 2.0f };
+
+    int x = i % 2;
+    int y = (i / 2) % 2;
+    int z = (i / 4) % 2;
+
+    o.center.x += (x == 1 ? 1.0f : -1.0f) * o.length / 2.0f;
+    o.center.y += (y == 1 ? 1.0f : -1.0f) * o.length / 2.0f;
+    o.center.z += (z == 1 ? 1.0f : -1.0f) * o.length / 2.0f;
+
+    return o;
+}
+
+// Adds m (3 d d^T - |d|^2 I) to a quadrupole.
+static void AddPointQuadrupole(float* q, glm::vec3 d, float m)
 {
+    float d2 = glm::dot(d, d);
+    q[0] += m * (3.0f * d.x * d.x - d2);
+    q[1] += m * 3.0f * d.x * d.y;
+    q[2] += m * 3.0f * d.x * d.z;
+    q[3] += m * (3.0f * d.y * d.y - d2);
+    q[4] += m * 3.0f * d.y * d.z;
+    q[5] += m * (3.0f * d.z * d.z - d2);
 }
 
-BHTree::~BHTree()
+// Adds a node's quadrupole term to a walk's sums, which are scaled by G
+// afterwards. d points from the target to the node's center of mass and
+// inv is the softened inverse distance.
+static void AddQuadrupoleTerm(const float* q, glm::vec3 d, float inv, glm::vec3& acceleration, float& potential)
 {
-    for (int i = 0; i < 8; i++)
+    glm::vec3 qd(
+        q[0] * d.x + q[1] * d.y + q[2] * d.z,
+        q[1] * d.x + q[3] * d.y + q[4] * d.z,
+        q[2] * d.x + q[4] * d.y + q[5] * d.z);
+
+    float dqd = glm::dot(d, qd);
+    float inv2 = inv * inv;
+    float inv5 = inv2 * inv2 * inv;
+
+    acceleration += (2.5f * dqd * inv2 * d - qd) * inv5;
+    potential += 0.5f * dqd * inv5;
+}
+
+BHTree::BHTree()
+    : theta(THRESHOLD)
+    , quadrupole(true)
+    , leaf_capacity(LEAF_CAPACITY)
+{
+}
+
+void BHTree::Reset(Oct o)
+{
+    // clear() keeps the capacity, so after the first frame no allocation happens
+    nodes.clear();
+    nodes.push_back(BHNode{ o, glm::vec3(0.0f, 0.0f, 0.0f), 0.0f, { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f }, -1, 0, -1, 0, 0 });
+    parent_of.assign(1, -1);
+}
+
+void BHTree::Insert(ParticleView particles, int b)
+{
+    const glm::vec3 position = particles.Position(b);
+    const float mass = particles.m[b];
+
+    if (next.size() < particles.Size())
     {
-        delete subtree[i];
+        next.resize(particles.Size());
+        leaf_of.resize(particles.Size());
+    }
+
+    int node = 0;
+
+    for (int depth = 0;; ++depth)
+    {
+        BHNode& n = nodes[node];
+
+        n.center_of_mass = (n.center_of_mass * n.mass + position * mass) / (n.mass + mass);
+        n.mass = n.mass + mass;
+
+        if (n.first_child < 0)
+        {
+            // at the depth limit the leaf takes the body even when full
+            if (n.count < leaf_capacity || depth >= MAX_DEPTH)
+            {
+                next[b] = n.body;
+                n.body = b;
+                ++n.count;
+                leaf_of[b] = node;
+                return;
+            }
+
+            // split the full leaf and push its residents one level down;
+            // each child gets at most leaf_capacity of them
+            int resident = n.body;
+            n.body = -1;
+            n.count = 0;
+
+            int children = CreateSubtree(nodes, node);
+            parent_of.resize(nodes.size(), node);
+
+            while (resident >= 0)
+            {
+                int following = next[resident];
+                glm::vec3 p = particles.Position(resident);
+                float m = particles.m[resident];
+
+                const int c = children + nodes[node].oct.GetSubtree(p);
+                BHNode& child = nodes[c];
+                child.center_of_mass = (child.center_of_mass * child.mass + p * m) / (child.mass + m);
+                child.mass += m;
+                next[resident] = child.body;
+                child.body = resident;
+                ++child.count;
+                leaf_of[resident] = c;
+
+                resident = following;
+            }
+        }
+
+        node = nodes[node].first_child + nodes[node].oct.GetSubtree(position);
     }
 }
 
-void BHTree::Insert(Body* b, int depth)
+void BHTree::BuildMorton(Oct o, ParticleView particles, ThreadPool* pool)
 {
-    if (depth > MAX_DEPTH)
+    const int n = static_cast<int>(particles.Size());
+    const glm::vec3 min_corner = o.center - glm::vec3(o.length / 2.0f);
+
+    keys.resize(n);
+    order.resize(n);
+    next.resize(n);
+    leaf_of.resize(n);
+
+    auto compute_keys = [&](int begin, int end, int)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            keys[i] = MortonKey(particles.Position(i), min_corner, o.length);
+            order[i] = i;
+        }
+    };
+
+    if (pool)
     {
+        pool->ParallelFor(n, 4096, compute_keys);
+    }
+    else
+    {
+        compute_keys(0, n, 0);
+    }
+
+    RadixSort(keys, order, key_scratch, order_scratch, count_scratch, pool);
+
+    Reset(o);
+
+    if (!pool || pool->ThreadCount() == 1 || n < PARALLEL_BUILD_MIN)
+    {
+        ranges.clear();
+        ranges.push_back(KeyRange{ 0, 0, n, 0 });
+        SplitRanges(nodes, ranges, particles, -1, nullptr);
+        SummarizeSubtrees(nodes, 0, static_cast<int>(nodes.size()));
+        IndexParents();
         return;
     }
 
-    if (!contains_body)
+    // build the top few levels here, and leave every range that reaches
+    // PARALLEL_SPLIT_DEPTH to be built as an independent subtree
+    tasks.clear();
+    ranges.clear();
+    ranges.push_back(KeyRange{ 0, 0, n, 0 });
+    SplitRanges(nodes, ranges, particles, PARALLEL_SPLIT_DEPTH, &tasks);
+
+    const int top_count = static_cast<int>(nodes.size());
+    const int task_count = static_cast<int>(tasks.size());
+
+    if (static_cast<int>(subtrees.size()) < task_count)
     {
-        body = b;
-        contains_body = true;
-        is_external = true;
+        subtrees.resize(task_count);
+    }
+    thread_ranges.resize(pool->ThreadCount());
+
+    // each subtree goes into its own node array, with its root at index 0,
+    // and gets its mass summaries there
+    pool->ParallelFor(task_count, 1, [&](int begin, int end, int thread)
+    {
+        for (int t = begin; t < end; ++t)
+        {
+            std::vector<BHNode>& local = subtrees[t];
+            std::vector<KeyRange>& stack = thread_ranges[thread];
+
+            local.clear();
+            local.push_back(nodes[tasks[t].node]);
 
+            stack.clear();
+            stack.push_back(KeyRange{ 0, tasks[t].begin, tasks[t].end, tasks[t].depth });
+            SplitRanges(local, stack, particles, -1, nullptr);
+            SummarizeSubtrees(local, 0, static_cast<int>(local.size()));
+        }
+    });
+
+    // lay the subtrees out one after another behind the top levels; the
+    // local root replaces the placeholder node that the task started from
+    task_offsets.resize(task_count);
+
+    int total = top_count;
+    for (int t = 0; t < task_count; ++t)
+    {
+        task_offsets[t] = total - 1;
+        total += static_cast<int>(subtrees[t].size()) - 1;
     }
-    else
+
+    nodes.resize(total);
+
+    pool->ParallelFor(task_count, 1, [&](int begin, int end, int)
     {
-        if (!is_external)
+        for (int t = begin; t < end; ++t)
         {
-            CreateSubtree(b);
-            subtree[oct.GetSubtree(b)]->Insert(b, depth + 1);
+            const std::vector<BHNode>& local = subtrees[t];
+            const int offset = task_offsets[t];
+
+            for (int i = 0; i < static_cast<int>(local.size()); ++i)
+            {
+                BHNode node = local[i];
+                const int placed = i == 0 ? tasks[t].node : offset + i;
+                if (node.first_child >= 0)
+                {
+                    node.first_child += offset;
+                }
+                // leaves were recorded under their index in the subtree
+                for (int b = node.body; b >= 0; b = next[b])
+                {
+                    leaf_of[b] = placed;
+                }
+                nodes[placed] = node;
+            }
         }
-        else
+    });
+
+    // only the top levels still need their summaries merged upward
+    SummarizeSubtrees(nodes, 0, top_count);
+    IndexParents();
+}
+
+void BHTree::SplitRanges(std::vector<BHNode>& out, std::vector<KeyRange>& stack,
+    ParticleView particles, int stop_depth, std::vector<KeyRange>* deferred)
+{
+    // every node covers a contiguous run of sorted keys, and its children
+    // split that run by the key's octant digit at the node's depth
+    while (!stack.empty())
+    {
+        KeyRange r = stack.back();
+        stack.pop_back();
+
+        out[r.node].begin = r.begin;
+        out[r.node].end = r.end;
+
+        if (r.begin == r.end)
         {
-            CreateSubtree(b);
-            subtree[oct.GetSubtree(b)]->Insert(b, depth + 1);
+            continue;
+        }
 
-            CreateSubtree(body);
-            subtree[oct.GetSubtree(body)]->Insert(body, depth + 1);
+        // up to leaf_capacity bodies, or any number sharing the finest
+        // cell, end up in one leaf, chained in Morton order
+        if (r.end - r.begin <= leaf_capacity || r.depth >= MORTON_BITS || r.depth >= MAX_DEPTH)
+        {
+            BHNode& leaf = out[r.node];
+            leaf.body = order[r.begin];
+            leaf.count = r.end - r.begin;
 
-            body = nullptr;
-            is_external = false;
+            for (int i = r.begin; i < r.end; ++i)
+            {
+                next[order[i]] = i + 1 < r.end ? order[i + 1] : -1;
+                leaf_of[order[i]] = r.node;
+            }
+
+            SummarizeLeaf(leaf, particles);
+            continue;
+        }
+
+        if (r.depth == stop_depth)
+        {
+            deferred->push_back(r);
+            continue;
+        }
+
+        int children = CreateSubtree(out, r.node);
+        int begin = r.begin;
+
+        for (int i = 0; i < 8; ++i)
+        {
+            int end = static_cast<int>(std::partition_point(keys.begin() + begin, keys.begin() + r.end,
+                [&](uint64_t key) { return MortonOctant(key, r.depth) <= i; }) - keys.begin());
+
+            stack.push_back(KeyRange{ children + i, begin, end, r.depth + 1 });
+            begin = end;
         }
     }
-    center_of_mass = (center_of_mass * mass + b->Position * b->Mass) / (mass + b->Mass);
-    mass = mass + b->Mass;
 }
 
-void BHTree::UpdateForce(Body* b)
+void BHTree::SummarizeSubtrees(std::vector<BHNode>& out, int begin, int end)
 {
-    if (is_external)
+    // children are always stored after their parent, so a reverse sweep
+    // sees every child before the node that owns it
+    for (int i = end - 1; i >= begin; --i)
     {
-        if (body != b)
-        {
-            float F = G_CONST * b->Mass * body->Mass /
-                sqrt(glm::distance2(b->Position, body->Position) + E_CONST);
+        BHNode& n = out[i];
 
-            glm::vec3 Direction = glm::normalize(b->Position - body->Position);
+        // leaves got their bodies' summary when they were created
+        if (n.first_child < 0)
+        {
+            continue;
+        }
 
-            b->Velocity -= Direction * F / b->Mass;
+        glm::vec3 weighted(0.0f, 0.0f, 0.0f);
+        float mass = 0.0f;
 
+        for (int c = n.first_child; c < n.first_child + 8; ++c)
+        {
+            weighted += out[c].center_of_mass * out[c].mass;
+            mass += out[c].mass;
         }
 
+        n.mass = mass;
+        n.center_of_mass = mass > 0.0f ? weighted / mass : n.oct.center;
+
+        // each child's quadrupole, shifted from its center of mass to ours
+        std::fill(n.quadrupole, n.quadrupole + 6, 0.0f);
+
+        for (int c = n.first_child; c < n.first_child + 8; ++c)
+        {
+            const BHNode& child = out[c];
+            for (int k = 0; k < 6; ++k)
+            {
+                n.quadrupole[k] += child.quadrupole[k];
+            }
+            AddPointQuadrupole(n.quadrupole, child.center_of_mass - n.center_of_mass, child.mass);
+        }
     }
-    else
+}
+
+void BHTree::Refit(ParticleView particles)
+{
+    for (BHNode& n : nodes)
     {
-        float sd = oct.length / glm::distance(b->Position, center_of_mass);
+        if (n.body >= 0)
+        {
+            SummarizeLeaf(n, particles);
+        }
+    }
+
+    SummarizeSubtrees(nodes, 0, static_cast<int>(nodes.size()));
+}
 
-        if (sd > THRESHOLD)
+WalkCount BHTree::Evaluate(ParticleView particles, glm::vec3 position, int skip, AccelOut out, int index) const
+{
+    glm::vec3 acceleration(0.0f, 0.0f, 0.0f);
+    float potential = 0.0f;
+
+    int stack[8 * (MAX_DEPTH + 2)];
+    int top = 0;
+    WalkCount count{ 0, 0 };
+
+    // the cells holding skip, root last; the walk reaches them root first
+    // and one at a time, so only the next one has to be compared against
+    int holding[MAX_DEPTH + 2];
+    int holding_count = 0;
+
+    if (skip >= 0)
+    {
+        for (int c = leaf_of[skip]; c >= 0; c = parent_of[c])
         {
-            float F = G_CONST * b->Mass * mass /
-                sqrt(glm::distance2(b->Position, center_of_mass) + E_CONST);
+            holding[holding_count++] = c;
+        }
+    }
 
-            glm::vec3 Direction = glm::normalize(b->Position - center_of_mass);
+    stack[top++] = 0;
 
-            b->Velocity -= Direction * F / b->Mass;
+    while (top > 0)
+    {
+        const int node = stack[--top];
+        const BHNode& n = nodes[node];
 
+        const bool holds_skip = holding_count > 0 && holding[holding_count - 1] == node;
+        if (holds_skip)
+        {
+            --holding_count;
         }
-        else
+
+        if (n.mass == 0.0f)
         {
-            for (int i = 0; i < 8; ++i)
+            continue;
+        }
+
+        const bool open = holds_skip || n.oct.length / glm::distance(position, n.center_of_mass) >= theta;
+
+        // a leaf is summed body by body when it is close or holds skip
+        if (n.first_child < 0 && (open || n.count == 1))
+        {
+            for (int b = n.body; b >= 0; b = next[b])
             {
-                if (subtree[i])
+                if (b == skip)
                 {
-                    subtree[i]->UpdateForce(b);
+                    continue;
                 }
+
+                glm::vec3 d = particles.Position(b) - position;
+                float inv = 1.0f / sqrt(glm::dot(d, d) + SOFTENING2);
+
+                acceleration += d * (particles.m[b] * inv * inv * inv);
+                potential += particles.m[b] * inv;
+                ++count.bodies;
             }
+            continue;
+        }
 
+        if (n.first_child >= 0 && open)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                stack[top++] = n.first_child + i;
+            }
+            continue;
         }
+
+        glm::vec3 d = n.center_of_mass - position;
+        float inv = 1.0f / sqrt(glm::dot(d, d) + SOFTENING2);
+
+        acceleration += d * (n.mass * inv * inv * inv);
+        potential += n.mass * inv;
+        ++count.nodes;
+
+        if (quadrupole)
+        {
+            AddQuadrupoleTerm(n.quadrupole, d, inv, acceleration, potential);
+        }
+    }
+
+    out.ax[index] = G_CONST * acceleration.x;
+    out.ay[index] = G_CONST * acceleration.y;
+    out.az[index] = G_CONST * acceleration.z;
+
+    if (out.phi)
+    {
+        out.phi[index] = -G_CONST * potential;
     }
+
+    return count;
 }
 
-void BHTree::CreateSubtree(Body* b)
+void BHTree::FindGroups(int max_size, std::vector<int>& groups) const
 {
-    int i = oct.GetSubtree(b);
+    groups.clear();
 
-    // checks if null ptr or not
-    if (subtree[i])
+    std::vector<int> stack(1, 0);
+
+    while (!stack.empty())
     {
-        return;
+        int node = stack.back();
+        stack.pop_back();
+
+        const BHNode& n = nodes[node];
+        int count = n.end - n.begin;
+
+        if (count <= 0)
+        {
+            continue;
+        }
+
+        if (count <= max_size || n.first_child < 0)
+        {
+            groups.push_back(node);
+            continue;
+        }
+
+        for (int i = 7; i >= 0; --i)
+        {
+            stack.push_back(n.first_child + i);
+        }
     }
+}
 
-    Oct o{ oct.center, oct.length / 2.0f };
+WalkCount BHTree::EvaluateGroup(ParticleView particles, int group, AccelOut out, GroupScratch& scratch) const
+{
+    const BHNode& g = nodes[group];
+    const int count = g.end - g.begin;
 
-    int x = i % 2;
-    int y = (i / 2) % 2;
-    int z = (i / 4) % 2;
+    for (AlignedVector<float>* column : { &scratch.tx, &scratch.ty, &scratch.tz, &scratch.ax, &scratch.ay, &scratch.az, &scratch.phi })
+    {
+        column->assign(count, 0.0f);
+    }
 
-    if (x == 1)
+    // the group's bodies, and the box around them
+    glm::vec3 low(particles.Position(order[g.begin]));
+    glm::vec3 high(low);
+
+    for (int k = 0; k < count; ++k)
     {
-        o.center.x = o.center.x + o.length / 2.0f;
+        glm::vec3 p = particles.Position(order[g.begin + k]);
+        scratch.tx[k] = p.x;
+        scratch.ty[k] = p.y;
+        scratch.tz[k] = p.z;
+        low = glm::min(low, p);
+        high = glm::max(high, p);
     }
-    else
+
+    const glm::vec3 box_center = 0.5f * (low + high);
+    const glm::vec3 box_half = 0.5f * (high - low);
+
+    // one walk for the whole group. A cell is taken whole only if it passes
+    // the opening test from the nearest point of the box, so from every
+    // body in the group. The cells above the group hold its bodies, so
+    // they are always opened, and the cells below it have their centers of
+    // mass in the box; that puts the group's own bodies on the list rather
+    // than inside some cell's mass
+    scratch.x.clear();
+    scratch.y.clear();
+    scratch.z.clear();
+    scratch.m.clear();
+    for (AlignedVector<float>* column : { &scratch.qx, &scratch.qy, &scratch.qz,
+        &scratch.qxx, &scratch.qxy, &scratch.qxz, &scratch.qyy, &scratch.qyz, &scratch.qzz })
     {
-        o.center.x = o.center.x - o.length / 2.0f;
+        column->clear();
     }
+    scratch.stack.assign(1, 0);
 
-    if (y == 1)
+    // the group and the cells above it, root last, as in Evaluate
+    int holding[MAX_DEPTH + 2];
+    int holding_count = 0;
+
+    for (int c = group; c >= 0; c = parent_of[c])
     {
-        o.center.y = o.center.y + o.length / 2.0f;
+        holding[holding_count++] = c;
     }
-    else
+
+    WalkCount list{ 0, 0 };
+
+    while (!scratch.stack.empty())
     {
-        o.center.y = o.center.y - o.length / 2.0f;
+        const int node = scratch.stack.back();
+        const BHNode& n = nodes[node];
+        scratch.stack.pop_back();
+
+        const bool holds_group = holding_count > 0 && holding[holding_count - 1] == node;
+        if (holds_group)
+        {
+            --holding_count;
+        }
+
+        if (n.mass == 0.0f)
+        {
+            continue;
+        }
+
+        glm::vec3 gap = glm::max(glm::abs(n.center_of_mass - box_center) - box_half, glm::vec3(0.0f));
+        const bool open = holds_group || n.oct.length >= theta * glm::length(gap);
+
+        if (n.first_child < 0 && (open || n.count == 1))
+        {
+            for (int b = n.body; b >= 0; b = next[b])
+            {
+                scratch.x.push_back(particles.x[b]);
+                scratch.y.push_back(particles.y[b]);
+                scratch.z.push_back(particles.z[b]);
+                scratch.m.push_back(particles.m[b]);
+                ++list.bodies;
+            }
+            continue;
+        }
+
+        if (n.first_child >= 0 && open)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                scratch.stack.push_back(n.first_child + i);
+            }
+            continue;
+        }
+        ++list.nodes;
+
+        scratch.x.push_back(n.center_of_mass.x);
+        scratch.y.push_back(n.center_of_mass.y);
+        scratch.z.push_back(n.center_of_mass.z);
+        scratch.m.push_back(n.mass);
+
+        if (quadrupole)
+        {
+            scratch.qx.push_back(n.center_of_mass.x);
+            scratch.qy.push_back(n.center_of_mass.y);
+            scratch.qz.push_back(n.center_of_mass.z);
+            scratch.qxx.push_back(n.quadrupole[0]);
+            scratch.qxy.push_back(n.quadrupole[1]);
+            scratch.qxz.push_back(n.quadrupole[2]);
+            scratch.qyy.push_back(n.quadrupole[3]);
+            scratch.qyz.push_back(n.quadrupole[4]);
+            scratch.qzz.push_back(n.quadrupole[5]);
+        }
+    }
+
+    // zero-mass padding lets the kernel run whole vectors
+    size_t padded = (scratch.m.size() + PARTICLE_PADDING - 1) / PARTICLE_PADDING * PARTICLE_PADDING;
+    scratch.x.resize(padded, 0.0f);
+    scratch.y.resize(padded, 0.0f);
+    scratch.z.resize(padded, 0.0f);
+    scratch.m.resize(padded, 0.0f);
+
+    AccelOut local{ scratch.ax.data(), scratch.ay.data(), scratch.az.data(), out.phi ? scratch.phi.data() : nullptr };
+
+    DirectSum(scratch.x.data(), scratch.y.data(), scratch.z.data(), scratch.m.data(), static_cast<int>(padded),
+        scratch.tx.data(), scratch.ty.data(), scratch.tz.data(), 0, count, local, G_CONST, SOFTENING2);
+
+    // the cells' quadrupoles on top of the monopoles, padded the same way
+    if (quadrupole && !scratch.qx.empty())
+    {
+        size_t cells = (scratch.qx.size() + PARTICLE_PADDING - 1) / PARTICLE_PADDING * PARTICLE_PADDING;
+        for (AlignedVector<float>* column : { &scratch.qx, &scratch.qy, &scratch.qz,
+            &scratch.qxx, &scratch.qxy, &scratch.qxz, &scratch.qyy, &scratch.qyz, &scratch.qzz })
+        {
+            column->resize(cells, 0.0f);
+        }
+
+        QuadrupoleColumns moments{ scratch.qxx.data(), scratch.qxy.data(), scratch.qxz.data(),
+            scratch.qyy.data(), scratch.qyz.data(), scratch.qzz.data() };
+
+        QuadrupoleSum(scratch.qx.data(), scratch.qy.data(), scratch.qz.data(), moments, static_cast<int>(cells),
+            scratch.tx.data(), scratch.ty.data(), scratch.tz.data(), 0, count, local, G_CONST, SOFTENING2);
     }
 
-    if (z == 1)
+    const float self_potential = G_CONST / sqrt(SOFTENING2);
+
+    for (int k = 0; k < count; ++k)
     {
-        o.center.z = o.center.z + o.length / 2.0f;
+        int b = order[g.begin + k];
+        out.ax[b] = scratch.ax[k];
+        out.ay[b] = scratch.ay[k];
+        out.az[b] = scratch.az[k];
+
+        // each body is on its own list, which the kernel counts in its potential
+        if (out.phi)
+        {
+            out.phi[b] = scratch.phi[k] + self_potential * particles.m[b];
+        }
     }
-    else
+
+    return WalkCount{ list.nodes * count, list.bodies * count };
+}
+
+int BHTree::Depth() const
+{
+    if (nodes.empty())
+    {
+        return 0;
+    }
+
+    float smallest = nodes[0].oct.length;
+    for (const BHNode& n : nodes)
+    {
+        smallest = std::min(smallest, n.oct.length);
+    }
+
+    return static_cast<int>(std::round(std::log2(nodes[0].oct.length / smallest)));
+}
+
+void BHTree::SummarizeLeaf(BHNode& leaf, ParticleView particles) const
+{
+    glm::vec3 weighted(0.0f, 0.0f, 0.0f);
+    float mass = 0.0f;
+
+    for (int b = leaf.body; b >= 0; b = next[b])
+    {
+        weighted += particles.Position(b) * particles.m[b];
+        mass += particles.m[b];
+    }
+
+    leaf.mass = mass;
+    leaf.center_of_mass = mass > 0.0f ? weighted / mass : leaf.oct.center;
+
+    std::fill(leaf.quadrupole, leaf.quadrupole + 6, 0.0f);
+
+    for (int b = leaf.body; b >= 0; b = next[b])
+    {
+        AddPointQuadrupole(leaf.quadrupole, particles.Position(b) - leaf.center_of_mass, particles.m[b]);
+    }
+}
+
+void BHTree::IndexParents()
+{
+    const int count = static_cast<int>(nodes.size());
+
+    parent_of.resize(count);
+    parent_of[0] = -1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        const int first = nodes[i].first_child;
+        if (first >= 0)
+        {
+            std::fill(parent_of.begin() + first, parent_of.begin() + first + 8, i);
+        }
+    }
+}
+
+int BHTree::CreateSubtree(std::vector<BHNode>& out, int node)
+{
+    int first = static_cast<int>(out.size());
+    Oct parent = out[node].oct;
+
+    for (int i = 0; i < 8; ++i)
     {
-        o.center.z = o.center.z - o.length / 2.0f;
+        out.push_back(BHNode{ parent.GetChild(i), glm::vec3(0.0f, 0.0f, 0.0f), 0.0f, { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f }, -1, 0, -1, 0, 0 });
     }
 
-    subtree[i] = new BHTree(o);
+    out[node].first_child = first;
+    return first;
 }
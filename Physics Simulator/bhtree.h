@@ -1,34 +1,166 @@
 #pragma once
 
+#include "gravity.h"
+#include "particle_set.h"
+
 #include <glm/gtx/norm.hpp>
 
-class Body;
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
 
 struct Oct
 {
     glm::vec3 center;
     float length;
 
-    const bool Contains(Body* b);
-    const int GetSubtree(Body* b);
+    const bool Contains(glm::vec3 p);
+    const int GetSubtree(glm::vec3 p);
+    Oct GetChild(int i) const;
 };
 
-class BHTree
+// A single octree node. The eight children of a node are stored next to
+// each other in the node array, starting at first_child. A leaf holds count
+// bodies, chained through BHTree::next starting at body; body is -1 in an
+// empty leaf or a cell. BuildMorton also records the run [begin, end) of
+// the Morton order that the node covers.
+//
+// quadrupole is the traceless quadrupole moment about the center of mass,
+// sum of m (3 d d^T - |d|^2 I), stored as xx, xy, xz, yy, yz, zz.
+struct BHNode
 {
-public:
-    BHTree(Oct o);
-    ~BHTree();
-    void Insert(Body* b, int depth = 0);
-    void UpdateForce(Body* b);
-    void CreateSubtree(Body* b);
-
-    bool contains_body;
-    bool is_external;
-    Body* body;
     Oct oct;
 
     glm::vec3 center_of_mass;
     float mass;
+    float quadrupole[6];
+
+    int body;
+    int count;
+    int first_child;
+
+    int begin;
+    int end;
+};
+
+// What a force walk used: cells taken as a whole and single bodies in leaves.
+struct WalkCount
+{
+    int nodes;
+    int bodies;
+};
 
-    BHTree* subtree[8];
-};
\ No newline at end of file
+// Per-thread buffers for BHTree::EvaluateGroup, kept between calls so that
+// the walk does not allocate: the group's interaction list as point masses,
+// the quadrupoles of the cells on it, and the group's bodies with their
+// results.
+struct GroupScratch
+{
+    AlignedVector<float> x, y, z, m;
+    AlignedVector<float> qx, qy, qz, qxx, qxy, qxz, qyy, qyz, qzz;
+    AlignedVector<float> tx, ty, tz;
+    AlignedVector<float> ax, ay, az, phi;
+    std::vector<int> stack;
+};
+
+// How the tree is built each frame: one body at a time from the root, or
+// all at once from bodies sorted by Morton key.
+enum class TreeBuild
+{
+    Insert,
+    Morton
+};
+
+// Barnes-Hut octree kept in one contiguous array of nodes. The array is
+// reused between frames, so rebuilding the tree only resets its size.
+class BHTree
+{
+public:
+    BHTree();
+    void Reset(Oct o);
+    void Insert(ParticleView particles, int b);
+    void BuildMorton(Oct o, ParticleView particles, ThreadPool* pool = nullptr);
+    // moves the leaves to their bodies' current positions and redoes the
+    // mass summaries, keeping the cells; cheap enough to run between full
+    // builds while the bodies have only moved a little. Insert only keeps
+    // masses and centers of mass, so a tree built with it needs a Refit
+    // for its quadrupoles
+    void Refit(ParticleView particles);
+
+    // Stores the tree's acceleration at position, and its potential when
+    // out.phi is set, at out[index]. skip is a body left out of the sum,
+    // normally the target itself, or -1. The leaf holding skip and all its
+    // ancestors are always opened, so skip's own mass is never part of a
+    // cell taken whole, even once a Refit has left it outside the cell it
+    // was built into. Leaves are summed body by body from particles,
+    // which must be what the tree was built from. Only reads the tree, so
+    // any number of threads can evaluate at once. Returns what the walk
+    // used.
+    WalkCount Evaluate(ParticleView particles, glm::vec3 position, int skip, AccelOut out, int index) const;
+
+    // Splits a BuildMorton tree into groups of at most max_size bodies: the
+    // highest nodes that are small enough, or leaves. Every body ends up
+    // in exactly one group.
+    void FindGroups(int max_size, std::vector<int>& groups) const;
+
+    // Evaluate for every body of a group at once. One walk, with cells
+    // opened against the group's bounding box rather than a single body,
+    // gives an interaction list that is then summed for all the group's
+    // bodies with the SIMD direct kernel. Results go to out at each body's
+    // own index. Returns interactions, i.e. list entries times bodies.
+    WalkCount EvaluateGroup(ParticleView particles, int group, AccelOut out, GroupScratch& scratch) const;
+
+    // number of levels below the root, found from the cell sizes
+    int Depth() const;
+
+    std::vector<BHNode> nodes;
+
+    // opening angle: a cell is used whole when length / distance < theta
+    float theta;
+
+    // whether cells used whole add their quadrupole to their monopole,
+    // which allows a larger theta at the same error
+    bool quadrupole;
+
+    // bodies a leaf holds before it is split. Bodies too close together to
+    // separate within the depth limit share one leaf past this size
+    int leaf_capacity;
+
+    // next body in the same leaf, or -1, for every body in the tree
+    std::vector<int> next;
+
+    // filled by BuildMorton: body indices in Morton order and their keys
+    std::vector<int> order;
+    std::vector<uint64_t> keys;
+
+private:
+    struct KeyRange
+    {
+        int node, begin, end, depth;
+    };
+
+    static int CreateSubtree(std::vector<BHNode>& out, int node);
+    void IndexParents();
+    void SummarizeLeaf(BHNode& leaf, ParticleView particles) const;
+    static void SummarizeSubtrees(std::vector<BHNode>& out, int begin, int end);
+    void SplitRanges(std::vector<BHNode>& out, std::vector<KeyRange>& stack,
+        ParticleView particles, int stop_depth, std::vector<KeyRange>* deferred);
+
+    std::vector<uint64_t> key_scratch;
+    std::vector<int> order_scratch;
+    std::vector<size_t> count_scratch;
+    std::vector<KeyRange> ranges;
+
+    // the leaf each body went into when the tree was built, and the
+    // parent of each node (-1 for the root), so that Evaluate can find
+    // the cells that hold skip; Refit keeps both
+    std::vector<int> leaf_of;
+    std::vector<int> parent_of;
+
+    // parallel build: subtrees left for the workers and their node arrays
+    std::vector<KeyRange> tasks;
+    std::vector<std::vector<BHNode>> subtrees;
+    std::vector<std::vector<KeyRange>> thread_ranges;
+    std::vector<int> task_offsets;
+};
@@ -0,0 +1,318 @@
+#include "checkpoint.h"
+
+#include "gravity.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(CheckpointHeader) == 56, "CheckpointHeader must not have padding");
+static_assert(sizeof(CheckpointColumn) == 24, "CheckpointColumn must not have padding");
+
+// alignment of every column in the file, so a mapped column is as aligned
+// as a ParticleSet one
+const uint64_t CHECKPOINT_ALIGNMENT = 64;
+
+static uint64_t AlignUp(uint64_t offset)
+{
+    return (offset + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+}
+
+// What a column is called in the file and where it lives in a ParticleSet.
+struct ColumnSource
+{
+    const char* name;
+    uint32_t element_bytes;
+    const void* data;
+};
+
+static CheckpointColumn MakeColumn(const char* name, uint32_t element_bytes, uint64_t offset)
+{
+    CheckpointColumn column;
+    std::memset(&column, 0, sizeof(column));
+    // zero-padded, not terminated: a full eight-character name fills it
+    std::memcpy(column.name, name, std::min(std::strlen(name), sizeof(column.name)));
+    column.element_bytes = element_bytes;
+    column.offset = offset;
+    return column;
+}
+
+// Flushes an open file all the way to the disk, so that a rename after it
+// cannot be seen before the data.
+static bool SyncFile(FILE* file)
+{
+    if (std::fflush(file) != 0)
+    {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Moves from over to, replacing to in one step.
+static bool ReplaceFile(const std::string& from, const std::string& to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (std::rename(from.c_str(), to.c_str()) != 0)
+    {
+        return false;
+    }
+
+    // the rename itself is only on disk once its directory is
+    size_t slash = to.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : to.substr(0, slash + 1);
+
+    int handle = open(directory.c_str(), O_RDONLY);
+    if (handle >= 0)
+    {
+        fsync(handle);
+        close(handle);
+    }
+    return true;
+#endif
+}
+
+bool WriteCheckpoint(const std::string& path, const ParticleSet& particles, const CheckpointInfo& info, std::string& error)
+{
+    const uint64_t count = particles.Size();
+
+    const ColumnSource sources[] = {
+        { "x", sizeof(float), particles.x.data() },
+        { "y", sizeof(float), particles.y.data() },
+        { "z", sizeof(float), particles.z.data() },
+        { "vx", sizeof(float), particles.vx.data() },
+        { "vy", sizeof(float), particles.vy.data() },
+        { "vz", sizeof(float), particles.vz.data() },
+        { "m", sizeof(float), particles.m.data() },
+        { "id", sizeof(uint32_t), particles.id.data() },
+    };
+    const uint32_t column_count = sizeof(sources) / sizeof(sources[0]);
+
+    CheckpointHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.header_bytes = sizeof(CheckpointHeader);
+    header.count = count;
+    header.step = info.step;
+    header.time = info.time;
+    header.column_count = column_count;
+    header.byte_order = CHECKPOINT_BYTE_ORDER;
+    header.gravity = G_CONST;
+    header.softening2 = SOFTENING2;
+
+    std::vector<CheckpointColumn> columns;
+    uint64_t offset = AlignUp(sizeof(CheckpointHeader) + column_count * sizeof(CheckpointColumn));
+    for (const ColumnSource& source : sources)
+    {
+        columns.push_back(MakeColumn(source.name, source.element_bytes, offset));
+        offset = AlignUp(offset + count * source.element_bytes);
+    }
+
+    std::string temporary = path + ".tmp";
+
+    FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file)
+    {
+        error = "cannot open " + temporary;
+        return false;
+    }
+
+    static const char zeros[CHECKPOINT_ALIGNMENT] = {};
+    uint64_t written = 0;
+
+    auto write = [&](const void* data, uint64_t bytes)
+    {
+        if (std::fwrite(data, 1, static_cast<size_t>(bytes), file) != bytes)
+        {
+            return false;
+        }
+        written += bytes;
+        return true;
+    };
+
+    bool ok = write(&header, sizeof(header)) && write(columns.data(), columns.size() * sizeof(CheckpointColumn));
+
+    for (uint32_t c = 0; ok && c < column_count; ++c)
+    {
+        ok = write(zeros, columns[c].offset - written) && write(sources[c].data, count * sources[c].element_bytes);
+    }
+
+    ok = ok && SyncFile(file);
+    ok = std::fclose(file) == 0 && ok;
+
+    if (!ok)
+    {
+        std::remove(temporary.c_str());
+        error = "cannot write " + temporary;
+        return false;
+    }
+
+    if (!ReplaceFile(temporary, path))
+    {
+        std::remove(temporary.c_str());
+        error = "cannot rename " + temporary + " to " + path;
+        return false;
+    }
+
+    return true;
+}
+
+// The column called name, or null if there is none.
+static const CheckpointColumn* FindColumn(const CheckpointColumn* columns, uint32_t count, const char* name)
+{
+    for (uint32_t c = 0; c < count; ++c)
+    {
+        if (std::strncmp(columns[c].name, name, sizeof(columns[c].name)) == 0)
+        {
+            return &columns[c];
+        }
+    }
+    return nullptr;
+}
+
+bool ReadCheckpoint(const std::string& path, ParticleSet& particles, CheckpointInfo& info, std::string& error)
+{
+    MappedFile file;
+    if (!file.Open(path))
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    const unsigned char* data = file.Data();
+    const uint64_t size = file.Size();
+
+    CheckpointHeader header;
+    if (size < sizeof(header))
+    {
+        error = path + " is too short for a checkpoint";
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error = path + " is not a checkpoint";
+        return false;
+    }
+    if (header.byte_order != CHECKPOINT_BYTE_ORDER)
+    {
+        error = path + " was written with the other byte order";
+        return false;
+    }
+    if (header.version > CHECKPOINT_VERSION)
+    {
+        error = path + " is checkpoint version " + std::to_string(header.version) +
+            ", newer than this build reads (" + std::to_string(CHECKPOINT_VERSION) + ")";
+        return false;
+    }
+    // restoring under another force law would quietly change the dynamics
+    if (header.gravity != G_CONST || header.softening2 != SOFTENING2)
+    {
+        error = path + " was written with a different force law (G " + std::to_string(header.gravity) +
+            ", softening^2 " + std::to_string(header.softening2) + ")";
+        return false;
+    }
+    if (header.version == 0 || header.header_bytes < sizeof(header) ||
+        header.header_bytes + static_cast<uint64_t>(header.column_count) * sizeof(CheckpointColumn) > size)
+    {
+        error = path + " has a broken header";
+        return false;
+    }
+
+    std::vector<CheckpointColumn> columns(header.column_count);
+    std::memcpy(columns.data(), data + header.header_bytes, columns.size() * sizeof(CheckpointColumn));
+
+    const uint64_t count = header.count;
+
+    // every column is checked before particles is touched
+    auto locate = [&](const char* name, uint32_t element_bytes, bool required, const void*& out)
+    {
+        out = nullptr;
+
+        const CheckpointColumn* column = FindColumn(columns.data(), header.column_count, name);
+        if (!column)
+        {
+            if (required)
+            {
+                error = path + " has no column " + name;
+            }
+            return !required;
+        }
+
+        if (column->element_bytes != element_bytes || column->offset > size ||
+            count > (size - column->offset) / element_bytes)
+        {
+            error = path + " has a broken column " + name;
+            return false;
+        }
+
+        out = data + column->offset;
+        return true;
+    };
+
+    struct FloatColumn
+    {
+        const char* name;
+        AlignedVector<float>* destination;
+        const void* source;
+    };
+
+    FloatColumn float_columns[] = {
+        { "x", &particles.x, nullptr },
+        { "y", &particles.y, nullptr },
+        { "z", &particles.z, nullptr },
+        { "vx", &particles.vx, nullptr },
+        { "vy", &particles.vy, nullptr },
+        { "vz", &particles.vz, nullptr },
+        { "m", &particles.m, nullptr },
+    };
+    const void* ids = nullptr;
+
+    for (FloatColumn& column : float_columns)
+    {
+        if (!locate(column.name, sizeof(float), true, column.source))
+        {
+            return false;
+        }
+    }
+    if (!locate("id", sizeof(uint32_t), false, ids))
+    {
+        return false;
+    }
+
+    particles.Clear();
+    particles.Resize(static_cast<size_t>(count));
+
+    for (const FloatColumn& column : float_columns)
+    {
+        std::memcpy(column.destination->data(), column.source, static_cast<size_t>(count) * sizeof(float));
+    }
+    if (ids)
+    {
+        std::memcpy(particles.id.data(), ids, static_cast<size_t>(count) * sizeof(uint32_t));
+    }
+
+    info.step = header.step;
+    info.time = header.time;
+    return true;
+}
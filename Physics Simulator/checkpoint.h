@@ -0,0 +1,69 @@
+#pragma once
+
+#include "particle_set.h"
+
+#include <cstdint>
+#include <string>
+
+// Binary checkpoint of every body, for restarting a run where it stopped.
+//
+// Layout, all little-endian:
+//     CheckpointHeader
+//     CheckpointColumn[header.column_count], starting at header.header_bytes
+//     the columns, each count elements at its offset, 64-byte aligned
+//
+// Columns are found by name, so a later version can add columns without
+// breaking readers of this one. Version 1 writes x, y, z, vx, vy, vz, m as
+// float32 and id as uint32. Readers need every float column; a file
+// without id numbers its bodies by index.
+const char CHECKPOINT_MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P' };
+const uint32_t CHECKPOINT_VERSION = 1;
+// written as is, so a reader on a machine with the other byte order sees
+// it reversed
+const uint32_t CHECKPOINT_BYTE_ORDER = 0x01020304;
+
+struct CheckpointHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint64_t count;
+    uint64_t step;
+    double time;
+    uint32_t column_count;
+    uint32_t byte_order;
+    // force law the run used, from gravity.h
+    float gravity;
+    float softening2;
+};
+
+struct CheckpointColumn
+{
+    // zero-padded, e.g. "vx"
+    char name[8];
+    uint32_t element_bytes;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+// Where the run was when the checkpoint was taken.
+struct CheckpointInfo
+{
+    uint64_t step;
+    double time;
+};
+
+// Writes every body to path. The file is written under a temporary name
+// and renamed over path once it is complete and flushed to disk, so path
+// always holds either the old checkpoint or the new one, even if the
+// process dies halfway. On failure returns false with a message in error.
+bool WriteCheckpoint(const std::string& path, const ParticleSet& particles, const CheckpointInfo& info, std::string& error);
+
+// Replaces particles with the bodies in the checkpoint at path. The file is
+// memory mapped and each column copied in one go, so there is no per-body
+// parsing. Accelerations are not stored and come back zero. A checkpoint
+// from a newer version, or from a build with another G_CONST or
+// SOFTENING2, is refused rather than run under the wrong force law. On
+// failure returns false with a message in error and leaves particles as
+// they were.
+bool ReadCheckpoint(const std::string& path, ParticleSet& particles, CheckpointInfo& info, std::string& error);
@@ -0,0 +1,522 @@
+#include "column_export.h"
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#ifdef NBODY_HAVE_HDF5
+#include <hdf5.h>
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(ColumnFileHeader) == 48, "ColumnFileHeader must not have padding");
+static_assert(sizeof(ColumnDescriptor) == 40, "ColumnDescriptor must not have padding");
+static_assert(sizeof(ColumnChunk) == 24, "ColumnChunk must not have padding");
+
+// alignment of every chunk in a native file
+const uint64_t COLUMN_ALIGNMENT = 64;
+
+static uint64_t AlignUp(uint64_t offset)
+{
+    return (offset + COLUMN_ALIGNMENT - 1) / COLUMN_ALIGNMENT * COLUMN_ALIGNMENT;
+}
+
+// A column as it is in a ParticleSet: one array per component.
+struct ParticleColumn
+{
+    const char* name;
+    ColumnType type;
+    uint32_t components;
+    const void* data[3];
+};
+
+static std::vector<ParticleColumn> Sources(const ParticleSet& particles, const float* potential)
+{
+    std::vector<ParticleColumn> sources = {
+        { "id", COLUMN_UINT32, 1, { particles.id.data() } },
+        { "position", COLUMN_FLOAT32, 3, { particles.x.data(), particles.y.data(), particles.z.data() } },
+        { "velocity", COLUMN_FLOAT32, 3, { particles.vx.data(), particles.vy.data(), particles.vz.data() } },
+        { "mass", COLUMN_FLOAT32, 1, { particles.m.data() } },
+        { "acceleration", COLUMN_FLOAT32, 3, { particles.ax.data(), particles.ay.data(), particles.az.data() } },
+    };
+
+    if (potential)
+    {
+        sources.push_back(ParticleColumn{ "potential", COLUMN_FLOAT32, 1, { potential } });
+    }
+    return sources;
+}
+
+// Interleaves rows [row, row + rows) of a column into out, components
+// side by side. Both element types are four bytes.
+static void GatherRows(const ParticleColumn& source, size_t row, size_t rows, uint32_t* out)
+{
+    const uint32_t components = source.components;
+
+    for (uint32_t c = 0; c < components; ++c)
+    {
+        const uint32_t* column = static_cast<const uint32_t*>(source.data[c]) + row;
+        for (size_t r = 0; r < rows; ++r)
+        {
+            out[r * components + c] = column[r];
+        }
+    }
+}
+
+// Runs body(begin, end, thread) over [0, count) on pool, or on the calling
+// thread alone without one.
+template <typename Body>
+static void ForEachChunk(ThreadPool* pool, int count, int chunk, Body body)
+{
+    if (pool)
+    {
+        pool->ParallelFor(count, chunk, body);
+    }
+    else
+    {
+        body(0, count, 0);
+    }
+}
+
+static bool EndsWith(const std::string& text, const char* suffix)
+{
+    size_t length = std::strlen(suffix);
+    return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+bool ColumnExportHasHdf5()
+{
+#ifdef NBODY_HAVE_HDF5
+    return true;
+#else
+    return false;
+#endif
+}
+
+// A file written at explicit offsets, safe to write from several threads
+// at once.
+class PositionedFile
+{
+public:
+    PositionedFile()
+#ifdef _WIN32
+        : handle(INVALID_HANDLE_VALUE)
+#else
+        : handle(-1)
+#endif
+    {
+    }
+
+    ~PositionedFile()
+    {
+        Close();
+    }
+
+    bool Create(const std::string& path)
+    {
+#ifdef _WIN32
+        handle = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return handle != INVALID_HANDLE_VALUE;
+#else
+        handle = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return handle >= 0;
+#endif
+    }
+
+    bool WriteAt(const void* data, uint64_t bytes, uint64_t offset)
+    {
+        const char* p = static_cast<const char*>(data);
+
+        while (bytes > 0)
+        {
+            // in pieces a single call can take on every platform
+            size_t piece = static_cast<size_t>(std::min<uint64_t>(bytes, 1 << 30));
+#ifdef _WIN32
+            OVERLAPPED at = {};
+            at.Offset = static_cast<DWORD>(offset);
+            at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+            DWORD written = 0;
+            if (!WriteFile(handle, p, static_cast<DWORD>(piece), &written, &at) || written == 0)
+            {
+                return false;
+            }
+#else
+            ssize_t written = pwrite(handle, p, piece, static_cast<off_t>(offset));
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+#endif
+            p += written;
+            bytes -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    bool Close()
+    {
+#ifdef _WIN32
+        bool ok = handle == INVALID_HANDLE_VALUE || CloseHandle(handle) != 0;
+        handle = INVALID_HANDLE_VALUE;
+#else
+        bool ok = handle < 0 || close(handle) == 0;
+        handle = -1;
+#endif
+        return ok;
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    int handle;
+#endif
+};
+
+static bool ExportNative(const std::string& path, const ParticleSet& particles, const ColumnExportFrame& frame,
+    const ColumnExportOptions& options, ThreadPool* pool, std::string& error)
+{
+    const uint64_t count = particles.Size();
+    const uint64_t chunk_rows = std::max<uint64_t>(1, options.chunk_rows);
+    const uint64_t chunks_per_column = (count + chunk_rows - 1) / chunk_rows;
+
+    const std::vector<ParticleColumn> sources = Sources(particles, frame.potential);
+    const uint32_t column_count = static_cast<uint32_t>(sources.size());
+
+    ColumnFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, COLUMN_FILE_MAGIC, sizeof(header.magic));
+    header.version = COLUMN_FILE_VERSION;
+    header.header_bytes = sizeof(ColumnFileHeader);
+    header.byte_order = COLUMN_FILE_BYTE_ORDER;
+    header.column_count = column_count;
+    header.count = count;
+    header.step = static_cast<uint64_t>(frame.step);
+    header.time = frame.time;
+
+    // the whole layout is settled up front, so chunks need not wait for
+    // each other
+    std::vector<ColumnDescriptor> descriptors(column_count);
+    std::vector<ColumnChunk> chunks;
+    std::vector<uint32_t> chunk_column;
+
+    uint64_t table = sizeof(ColumnFileHeader) + column_count * sizeof(ColumnDescriptor);
+    uint64_t offset = AlignUp(table + column_count * chunks_per_column * sizeof(ColumnChunk));
+
+    for (uint32_t c = 0; c < column_count; ++c)
+    {
+        ColumnDescriptor& descriptor = descriptors[c];
+        std::memset(&descriptor, 0, sizeof(descriptor));
+        std::strncpy(descriptor.name, sources[c].name, sizeof(descriptor.name));
+        descriptor.type = sources[c].type;
+        descriptor.components = sources[c].components;
+        descriptor.chunk_table = table + chunks.size() * sizeof(ColumnChunk);
+        descriptor.chunk_count = chunks_per_column;
+
+        for (uint64_t row = 0; row < count; row += chunk_rows)
+        {
+            uint64_t rows = std::min(chunk_rows, count - row);
+            chunks.push_back(ColumnChunk{ offset, row, rows });
+            chunk_column.push_back(c);
+            offset = AlignUp(offset + rows * sources[c].components * sizeof(uint32_t));
+        }
+    }
+
+    PositionedFile file;
+    if (!file.Create(path))
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    bool ok = file.WriteAt(&header, sizeof(header), 0) &&
+        file.WriteAt(descriptors.data(), descriptors.size() * sizeof(ColumnDescriptor), sizeof(header)) &&
+        (chunks.empty() || file.WriteAt(chunks.data(), chunks.size() * sizeof(ColumnChunk), table));
+
+    std::atomic<bool> failed(!ok);
+    std::vector<std::vector<uint32_t>> buffers(pool ? pool->ThreadCount() : 1);
+
+    ForEachChunk(pool, static_cast<int>(chunks.size()), 1, [&](int begin, int end, int thread)
+    {
+        std::vector<uint32_t>& buffer = buffers[thread];
+
+        for (int k = begin; k < end && !failed.load(std::memory_order_relaxed); ++k)
+        {
+            const ColumnChunk& chunk = chunks[k];
+            const ParticleColumn& source = sources[chunk_column[k]];
+
+            buffer.resize(static_cast<size_t>(chunk.rows) * source.components);
+            GatherRows(source, static_cast<size_t>(chunk.row), static_cast<size_t>(chunk.rows), buffer.data());
+
+            if (!file.WriteAt(buffer.data(), buffer.size() * sizeof(uint32_t), chunk.offset))
+            {
+                failed.store(true, std::memory_order_relaxed);
+            }
+        }
+    });
+
+    ok = file.Close() && !failed.load();
+    if (!ok)
+    {
+        error = "cannot write " + path;
+    }
+    return ok;
+}
+
+#ifdef NBODY_HAVE_HDF5
+
+static bool ExportHdf5(const std::string& path, const ParticleSet& particles, const ColumnExportFrame& frame,
+    const ColumnExportOptions& options, ThreadPool* pool, std::string& error)
+{
+    const hsize_t count = particles.Size();
+    const hsize_t chunk_rows = std::max<hsize_t>(1, std::min<hsize_t>(options.chunk_rows, count));
+
+    hid_t file = H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file < 0)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    bool ok = true;
+
+    auto attribute = [&](const char* name, hid_t type, const void* value)
+    {
+        hid_t space = H5Screate(H5S_SCALAR);
+        hid_t attr = H5Acreate2(file, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+        ok = ok && attr >= 0 && H5Awrite(attr, type, value) >= 0;
+        if (attr >= 0)
+        {
+            H5Aclose(attr);
+        }
+        H5Sclose(space);
+    };
+
+    long long step = frame.step;
+    attribute("step", H5T_NATIVE_LLONG, &step);
+    attribute("time", H5T_NATIVE_DOUBLE, &frame.time);
+
+    // the library is not thread-safe, so threads only interleave the
+    // vector columns and each dataset is written in one call
+    std::vector<uint32_t> rows;
+
+    for (const ParticleColumn& source : Sources(particles, frame.potential))
+    {
+        if (!ok)
+        {
+            break;
+        }
+
+        const int rank = source.components > 1 ? 2 : 1;
+        const hsize_t dims[2] = { count, source.components };
+        const hsize_t chunk[2] = { chunk_rows, source.components };
+
+        hid_t file_type = source.type == COLUMN_FLOAT32 ? H5T_IEEE_F32LE : H5T_STD_U32LE;
+        hid_t memory_type = source.type == COLUMN_FLOAT32 ? H5T_NATIVE_FLOAT : H5T_NATIVE_UINT32;
+
+        hid_t space = H5Screate_simple(rank, dims, nullptr);
+        hid_t properties = H5Pcreate(H5P_DATASET_CREATE);
+        if (count > 0)
+        {
+            H5Pset_chunk(properties, rank, chunk);
+        }
+
+        hid_t dataset = H5Dcreate2(file, source.name, file_type, space, H5P_DEFAULT, properties, H5P_DEFAULT);
+        ok = dataset >= 0;
+
+        if (ok && count > 0)
+        {
+            const void* data = source.data[0];
+
+            if (source.components > 1)
+            {
+                rows.resize(static_cast<size_t>(count) * source.components);
+                ForEachChunk(pool, static_cast<int>(count), static_cast<int>(chunk_rows), [&](int begin, int end, int)
+                {
+                    GatherRows(source, begin, end - begin, rows.data() + static_cast<size_t>(begin) * source.components);
+                });
+                data = rows.data();
+            }
+
+            ok = H5Dwrite(dataset, memory_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, data) >= 0;
+        }
+
+        if (dataset >= 0)
+        {
+            H5Dclose(dataset);
+        }
+        H5Pclose(properties);
+        H5Sclose(space);
+    }
+
+    ok = H5Fclose(file) >= 0 && ok;
+    if (!ok)
+    {
+        error = "cannot write " + path;
+    }
+    return ok;
+}
+
+#endif
+
+bool ExportColumns(const std::string& path, const ParticleSet& particles, const ColumnExportFrame& frame,
+    const ColumnExportOptions& options, ThreadPool* pool, std::string& error)
+{
+    if (EndsWith(path, ".h5") || EndsWith(path, ".hdf5"))
+    {
+#ifdef NBODY_HAVE_HDF5
+        return ExportHdf5(path, particles, frame, options, pool, error);
+#else
+        error = "cannot write " + path + ": this build has no HDF5 support";
+        return false;
+#endif
+    }
+
+    return ExportNative(path, particles, frame, options, pool, error);
+}
+
+ColumnFile::ColumnFile()
+    : header()
+{
+}
+
+bool ColumnFile::Open(const std::string& path, std::string& error)
+{
+    Close();
+    this->path = path;
+
+    if (!file.Open(path))
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    const unsigned char* data = file.Data();
+    const uint64_t size = file.Size();
+
+    if (size < sizeof(header))
+    {
+        error = path + " is too short for a column file";
+        Close();
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, COLUMN_FILE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error = path + " is not a column file";
+        Close();
+        return false;
+    }
+    if (header.byte_order != COLUMN_FILE_BYTE_ORDER)
+    {
+        error = path + " was written with the other byte order";
+        Close();
+        return false;
+    }
+    if (header.version == 0 || header.header_bytes < sizeof(header) ||
+        header.header_bytes + static_cast<uint64_t>(header.column_count) * sizeof(ColumnDescriptor) > size)
+    {
+        error = path + " has a broken header";
+        Close();
+        return false;
+    }
+
+    columns.resize(header.column_count);
+    std::memcpy(columns.data(), data + header.header_bytes, columns.size() * sizeof(ColumnDescriptor));
+    return true;
+}
+
+void ColumnFile::Close()
+{
+    file.Close();
+    columns.clear();
+    header = ColumnFileHeader();
+}
+
+const ColumnFileHeader& ColumnFile::Header() const
+{
+    return header;
+}
+
+const ColumnDescriptor* ColumnFile::Find(const std::string& name) const
+{
+    for (const ColumnDescriptor& column : columns)
+    {
+        if (std::strncmp(column.name, name.c_str(), sizeof(column.name)) == 0 && name.size() <= sizeof(column.name))
+        {
+            return &column;
+        }
+    }
+    return nullptr;
+}
+
+bool ColumnFile::Read(const std::string& name, std::vector<float>& out, std::string& error) const
+{
+    return ReadColumn(name, COLUMN_FLOAT32, out, error);
+}
+
+bool ColumnFile::Read(const std::string& name, std::vector<uint32_t>& out, std::string& error) const
+{
+    return ReadColumn(name, COLUMN_UINT32, out, error);
+}
+
+template <typename T>
+bool ColumnFile::ReadColumn(const std::string& name, ColumnType type, std::vector<T>& out, std::string& error) const
+{
+    const ColumnDescriptor* column = Find(name);
+    if (!column || column->type != type)
+    {
+        error = path + " has no " + (type == COLUMN_FLOAT32 ? "float" : "uint32") + " column " + name;
+        return false;
+    }
+
+    const unsigned char* data = file.Data();
+    const uint64_t size = file.Size();
+    const uint64_t components = column->components;
+
+    if (components == 0 || components > 16 || column->chunk_table > size ||
+        column->chunk_count > (size - column->chunk_table) / sizeof(ColumnChunk))
+    {
+        error = path + " has a broken column " + name;
+        return false;
+    }
+
+    out.resize(static_cast<size_t>(header.count * components));
+
+    // only this column's chunks are touched, so only their pages are read
+    for (uint64_t k = 0; k < column->chunk_count; ++k)
+    {
+        ColumnChunk chunk;
+        std::memcpy(&chunk, data + column->chunk_table + k * sizeof(ColumnChunk), sizeof(chunk));
+
+        const uint64_t bytes = chunk.rows * components * sizeof(T);
+        if (chunk.row > header.count || chunk.rows > header.count - chunk.row ||
+            chunk.offset > size || bytes > size - chunk.offset)
+        {
+            error = path + " has a broken column " + name;
+            return false;
+        }
+
+        std::memcpy(out.data() + chunk.row * components, data + chunk.offset, static_cast<size_t>(bytes));
+    }
+
+    return true;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "particle_set.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// Per-step export of every body as named columns, for analysis tools that
+// want one field without reading a whole snapshot:
+//
+//     id            uint32   count
+//     position      float32  count x 3
+//     velocity      float32  count x 3
+//     mass          float32  count
+//     acceleration  float32  count x 3
+//     potential     float32  count, when one is given
+//
+// Vector columns are stored row by row, x y z for each body, which is how
+// HDF5 tools expect an N x 3 dataset.
+//
+// Files ending in .h5 or .hdf5 are written as HDF5, one chunked dataset per
+// column and the step and time as attributes, in a build with
+// NBODY_HAVE_HDF5. Anything else gets the native layout, all little-endian:
+//
+//     ColumnFileHeader
+//     ColumnDescriptor[header.column_count], starting at header.header_bytes
+//     for each column, ColumnChunk[descriptor.chunk_count] at chunk_table
+//     the chunks, each rows x components values at its offset
+//
+// Every chunk's place in the file is known before any is written, so the
+// chunks are written in parallel, each with a positioned write of its own.
+const char COLUMN_FILE_MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'C', 'O', 'L' };
+const uint32_t COLUMN_FILE_VERSION = 1;
+const uint32_t COLUMN_FILE_BYTE_ORDER = 0x01020304;
+
+enum ColumnType : uint32_t
+{
+    COLUMN_FLOAT32 = 1,
+    COLUMN_UINT32 = 2,
+};
+
+struct ColumnFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint32_t byte_order;
+    uint32_t column_count;
+    uint64_t count;
+    uint64_t step;
+    double time;
+};
+
+struct ColumnDescriptor
+{
+    // zero-padded, e.g. "position"
+    char name[16];
+    uint32_t type;
+    uint32_t components;
+    uint64_t chunk_table;
+    uint64_t chunk_count;
+};
+
+struct ColumnChunk
+{
+    uint64_t offset;
+    // first row and how many rows follow it
+    uint64_t row;
+    uint64_t rows;
+};
+
+struct ColumnExportOptions
+{
+    // rows per chunk; a reader after a range of bodies reads only the
+    // chunks that hold it
+    size_t chunk_rows = 1 << 16;
+};
+
+// Where the run was, and the potential of every body if there is one.
+struct ColumnExportFrame
+{
+    long long step;
+    double time;
+    // particles.Size() values, or null to leave the column out
+    const float* potential;
+};
+
+// True if this build can write .h5 files.
+bool ColumnExportHasHdf5();
+
+// Writes every body to path, in the format its extension asks for. pool
+// writes chunks in parallel and may be null; it must not be in use by
+// another thread, so an exporter on a writer thread needs a pool of its
+// own. On failure returns false with a message in error.
+bool ExportColumns(const std::string& path, const ParticleSet& particles, const ColumnExportFrame& frame,
+    const ColumnExportOptions& options, ThreadPool* pool, std::string& error);
+
+// Reads single columns out of a native column file in place through a
+// memory mapping.
+class ColumnFile
+{
+public:
+    ColumnFile();
+
+    // On failure returns false with a message in error.
+    bool Open(const std::string& path, std::string& error);
+    void Close();
+
+    const ColumnFileHeader& Header() const;
+    // the column called name, or null if there is none
+    const ColumnDescriptor* Find(const std::string& name) const;
+
+    // Copies a column out, count x components values. False if there is
+    // no such column of that type.
+    bool Read(const std::string& name, std::vector<float>& out, std::string& error) const;
+    bool Read(const std::string& name, std::vector<uint32_t>& out, std::string& error) const;
+
+private:
+    template <typename T>
+    bool ReadColumn(const std::string& name, ColumnType type, std::vector<T>& out, std::string& error) const;
+
+    MappedFile file;
+    std::string path;
+    ColumnFileHeader header;
+    std::vector<ColumnDescriptor> columns;
+};
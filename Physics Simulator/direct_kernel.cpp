@@ -0,0 +1,588 @@
+#include "direct_kernel.h"
+
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define NBODY_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC compiles every intrinsic without extra flags; GCC and Clang need the
+// target enabled per function so the rest of the file stays baseline x86-64
+#if defined(_MSC_VER) && !defined(__clang__)
+#define NBODY_TARGET_AVX2
+#define NBODY_TARGET_AVX512
+#else
+#define NBODY_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define NBODY_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+// sources are processed in tiles small enough to stay in L1 across targets
+const int DIRECT_TILE = 2048;
+
+typedef void (*DirectSumFn)(const float*, const float*, const float*, const float*, int,
+    const float*, const float*, const float*, int, int,
+    AccelOut, float, float);
+
+typedef void (*QuadrupoleSumFn)(const float*, const float*, const float*, QuadrupoleColumns, int,
+    const float*, const float*, const float*, int, int,
+    AccelOut, float, float);
+
+// Every kernel comes in two versions, with and without the potential, so
+// the plain force pass pays nothing for it.
+template <bool Potential>
+static void SumTail(const float* x, const float* y, const float* z, const float* m, int j0, int j1,
+    float xi, float yi, float zi, float softening, float& ax, float& ay, float& az, float& phi)
+{
+    for (int j = j0; j < j1; ++j)
+    {
+        float dx = x[j] - xi;
+        float dy = y[j] - yi;
+        float dz = z[j] - zi;
+        float inv = 1.0f / std::sqrt(dx * dx + dy * dy + dz * dz + softening);
+        float s = m[j] * inv * inv * inv;
+
+        ax += dx * s;
+        ay += dy * s;
+        az += dz * s;
+
+        if (Potential)
+        {
+            phi += m[j] * inv;
+        }
+    }
+}
+
+template <bool Potential>
+static void QuadrupoleTail(const float* x, const float* y, const float* z, QuadrupoleColumns q, int j0, int j1,
+    float xi, float yi, float zi, float softening, float& ax, float& ay, float& az, float& phi)
+{
+    for (int j = j0; j < j1; ++j)
+    {
+        float dx = x[j] - xi;
+        float dy = y[j] - yi;
+        float dz = z[j] - zi;
+
+        float qdx = q.xx[j] * dx + q.xy[j] * dy + q.xz[j] * dz;
+        float qdy = q.xy[j] * dx + q.yy[j] * dy + q.yz[j] * dz;
+        float qdz = q.xz[j] * dx + q.yz[j] * dy + q.zz[j] * dz;
+        float dqd = dx * qdx + dy * qdy + dz * qdz;
+
+        float inv = 1.0f / std::sqrt(dx * dx + dy * dy + dz * dz + softening);
+        float inv2 = inv * inv;
+        float inv5 = inv2 * inv2 * inv;
+        float radial = 2.5f * dqd * inv2;
+
+        ax += (radial * dx - qdx) * inv5;
+        ay += (radial * dy - qdy) * inv5;
+        az += (radial * dz - qdz) * inv5;
+
+        if (Potential)
+        {
+            phi += 0.5f * dqd * inv5;
+        }
+    }
+}
+
+// adds one target's sums, scaled by g, to the output
+template <bool Potential>
+static void Store(AccelOut out, int i, float g, float ax, float ay, float az, float phi)
+{
+    out.ax[i] += g * ax;
+    out.ay[i] += g * ay;
+    out.az[i] += g * az;
+
+    if (Potential)
+    {
+        out.phi[i] -= g * phi;
+    }
+}
+
+#ifndef NBODY_X86
+
+template <bool Potential>
+static void DirectSumScalar(const float* x, const float* y, const float* z, const float* m, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    for (int t0 = 0; t0 < source_count; t0 += DIRECT_TILE)
+    {
+        int t1 = t0 + DIRECT_TILE < source_count ? t0 + DIRECT_TILE : source_count;
+
+        for (int i = begin; i < end; ++i)
+        {
+            float ax = 0.0f, ay = 0.0f, az = 0.0f, phi = 0.0f;
+            SumTail<Potential>(x, y, z, m, t0, t1, tx[i], ty[i], tz[i], softening, ax, ay, az, phi);
+            Store<Potential>(out, i, g, ax, ay, az, phi);
+        }
+    }
+}
+
+template <bool Potential>
+static void QuadrupoleSumScalar(const float* x, const float* y, const float* z, QuadrupoleColumns q, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    for (int i = begin; i < end; ++i)
+    {
+        float ax = 0.0f, ay = 0.0f, az = 0.0f, phi = 0.0f;
+        QuadrupoleTail<Potential>(x, y, z, q, 0, source_count, tx[i], ty[i], tz[i], softening, ax, ay, az, phi);
+        Store<Potential>(out, i, g, ax, ay, az, phi);
+    }
+}
+
+#endif
+
+#ifdef NBODY_X86
+
+static float HorizontalSum(__m128 v)
+{
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+template <bool Potential>
+static void DirectSumSSE(const float* x, const float* y, const float* z, const float* m, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    const __m128 eps = _mm_set1_ps(softening);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three_halves = _mm_set1_ps(1.5f);
+
+    for (int t0 = 0; t0 < source_count; t0 += DIRECT_TILE)
+    {
+        int t1 = t0 + DIRECT_TILE < source_count ? t0 + DIRECT_TILE : source_count;
+        int vector_end = t0 + (t1 - t0) / 4 * 4;
+
+        for (int i = begin; i < end; ++i)
+        {
+            const __m128 xi = _mm_set1_ps(tx[i]);
+            const __m128 yi = _mm_set1_ps(ty[i]);
+            const __m128 zi = _mm_set1_ps(tz[i]);
+
+            __m128 ax = _mm_setzero_ps();
+            __m128 ay = _mm_setzero_ps();
+            __m128 az = _mm_setzero_ps();
+            __m128 phi = _mm_setzero_ps();
+
+            for (int j = t0; j < vector_end; j += 4)
+            {
+                __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), xi);
+                __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), yi);
+                __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), zi);
+
+                __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                    _mm_add_ps(_mm_mul_ps(dz, dz), eps));
+
+                // rsqrt is good to 12 bits, one Newton step brings it to ~23
+                __m128 inv = _mm_rsqrt_ps(r2);
+                inv = _mm_mul_ps(inv, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, r2), _mm_mul_ps(inv, inv))));
+
+                __m128 mj = _mm_loadu_ps(m + j);
+                __m128 s = _mm_mul_ps(mj, _mm_mul_ps(inv, _mm_mul_ps(inv, inv)));
+
+                ax = _mm_add_ps(ax, _mm_mul_ps(dx, s));
+                ay = _mm_add_ps(ay, _mm_mul_ps(dy, s));
+                az = _mm_add_ps(az, _mm_mul_ps(dz, s));
+
+                if (Potential)
+                {
+                    phi = _mm_add_ps(phi, _mm_mul_ps(mj, inv));
+                }
+            }
+
+            float sx = HorizontalSum(ax);
+            float sy = HorizontalSum(ay);
+            float sz = HorizontalSum(az);
+            float sp = Potential ? HorizontalSum(phi) : 0.0f;
+            SumTail<Potential>(x, y, z, m, vector_end, t1, tx[i], ty[i], tz[i], softening, sx, sy, sz, sp);
+            Store<Potential>(out, i, g, sx, sy, sz, sp);
+        }
+    }
+}
+
+// Interaction lists are short, so the quadrupole kernels do not tile.
+template <bool Potential>
+static void QuadrupoleSumSSE(const float* x, const float* y, const float* z, QuadrupoleColumns q, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    const __m128 eps = _mm_set1_ps(softening);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three_halves = _mm_set1_ps(1.5f);
+    const __m128 five_halves = _mm_set1_ps(2.5f);
+    const int vector_end = source_count / 4 * 4;
+
+    for (int i = begin; i < end; ++i)
+    {
+        const __m128 xi = _mm_set1_ps(tx[i]);
+        const __m128 yi = _mm_set1_ps(ty[i]);
+        const __m128 zi = _mm_set1_ps(tz[i]);
+
+        __m128 ax = _mm_setzero_ps();
+        __m128 ay = _mm_setzero_ps();
+        __m128 az = _mm_setzero_ps();
+        __m128 phi = _mm_setzero_ps();
+
+        for (int j = 0; j < vector_end; j += 4)
+        {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), xi);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), yi);
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), zi);
+
+            __m128 qxx = _mm_loadu_ps(q.xx + j), qxy = _mm_loadu_ps(q.xy + j), qxz = _mm_loadu_ps(q.xz + j);
+            __m128 qyy = _mm_loadu_ps(q.yy + j), qyz = _mm_loadu_ps(q.yz + j), qzz = _mm_loadu_ps(q.zz + j);
+
+            __m128 qdx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qxx, dx), _mm_mul_ps(qxy, dy)), _mm_mul_ps(qxz, dz));
+            __m128 qdy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qxy, dx), _mm_mul_ps(qyy, dy)), _mm_mul_ps(qyz, dz));
+            __m128 qdz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qxz, dx), _mm_mul_ps(qyz, dy)), _mm_mul_ps(qzz, dz));
+            __m128 dqd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qdx), _mm_mul_ps(dy, qdy)), _mm_mul_ps(dz, qdz));
+
+            __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                _mm_add_ps(_mm_mul_ps(dz, dz), eps));
+
+            __m128 inv = _mm_rsqrt_ps(r2);
+            inv = _mm_mul_ps(inv, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, r2), _mm_mul_ps(inv, inv))));
+
+            __m128 inv2 = _mm_mul_ps(inv, inv);
+            __m128 inv5 = _mm_mul_ps(_mm_mul_ps(inv2, inv2), inv);
+            __m128 radial = _mm_mul_ps(_mm_mul_ps(five_halves, dqd), inv2);
+
+            ax = _mm_add_ps(ax, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(radial, dx), qdx), inv5));
+            ay = _mm_add_ps(ay, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(radial, dy), qdy), inv5));
+            az = _mm_add_ps(az, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(radial, dz), qdz), inv5));
+
+            if (Potential)
+            {
+                phi = _mm_add_ps(phi, _mm_mul_ps(_mm_mul_ps(half, dqd), inv5));
+            }
+        }
+
+        float sx = HorizontalSum(ax);
+        float sy = HorizontalSum(ay);
+        float sz = HorizontalSum(az);
+        float sp = Potential ? HorizontalSum(phi) : 0.0f;
+        QuadrupoleTail<Potential>(x, y, z, q, vector_end, source_count, tx[i], ty[i], tz[i], softening, sx, sy, sz, sp);
+        Store<Potential>(out, i, g, sx, sy, sz, sp);
+    }
+}
+
+NBODY_TARGET_AVX2 static float HorizontalSum(__m256 v)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuf = _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(sum, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+template <bool Potential>
+NBODY_TARGET_AVX2 static void DirectSumAVX2(const float* x, const float* y, const float* z, const float* m, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    const __m256 eps = _mm256_set1_ps(softening);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+
+    for (int t0 = 0; t0 < source_count; t0 += DIRECT_TILE)
+    {
+        int t1 = t0 + DIRECT_TILE < source_count ? t0 + DIRECT_TILE : source_count;
+        int vector_end = t0 + (t1 - t0) / 8 * 8;
+
+        for (int i = begin; i < end; ++i)
+        {
+            const __m256 xi = _mm256_set1_ps(tx[i]);
+            const __m256 yi = _mm256_set1_ps(ty[i]);
+            const __m256 zi = _mm256_set1_ps(tz[i]);
+
+            __m256 ax = _mm256_setzero_ps();
+            __m256 ay = _mm256_setzero_ps();
+            __m256 az = _mm256_setzero_ps();
+            __m256 phi = _mm256_setzero_ps();
+
+            for (int j = t0; j < vector_end; j += 8)
+            {
+                __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), xi);
+                __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + j), yi);
+                __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + j), zi);
+
+                __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_fmadd_ps(dz, dz, eps)));
+
+                __m256 inv = _mm256_rsqrt_ps(r2);
+                inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(inv, inv), three_halves));
+
+                __m256 mj = _mm256_loadu_ps(m + j);
+                __m256 s = _mm256_mul_ps(mj, _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+
+                ax = _mm256_fmadd_ps(dx, s, ax);
+                ay = _mm256_fmadd_ps(dy, s, ay);
+                az = _mm256_fmadd_ps(dz, s, az);
+
+                if (Potential)
+                {
+                    phi = _mm256_fmadd_ps(mj, inv, phi);
+                }
+            }
+
+            float sx = HorizontalSum(ax);
+            float sy = HorizontalSum(ay);
+            float sz = HorizontalSum(az);
+            float sp = Potential ? HorizontalSum(phi) : 0.0f;
+            SumTail<Potential>(x, y, z, m, vector_end, t1, tx[i], ty[i], tz[i], softening, sx, sy, sz, sp);
+            Store<Potential>(out, i, g, sx, sy, sz, sp);
+        }
+    }
+}
+
+template <bool Potential>
+NBODY_TARGET_AVX2 static void QuadrupoleSumAVX2(const float* x, const float* y, const float* z, QuadrupoleColumns q, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    const __m256 eps = _mm256_set1_ps(softening);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 five_halves = _mm256_set1_ps(2.5f);
+    const int vector_end = source_count / 8 * 8;
+
+    for (int i = begin; i < end; ++i)
+    {
+        const __m256 xi = _mm256_set1_ps(tx[i]);
+        const __m256 yi = _mm256_set1_ps(ty[i]);
+        const __m256 zi = _mm256_set1_ps(tz[i]);
+
+        __m256 ax = _mm256_setzero_ps();
+        __m256 ay = _mm256_setzero_ps();
+        __m256 az = _mm256_setzero_ps();
+        __m256 phi = _mm256_setzero_ps();
+
+        for (int j = 0; j < vector_end; j += 8)
+        {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), xi);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + j), yi);
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + j), zi);
+
+            __m256 qxx = _mm256_loadu_ps(q.xx + j), qxy = _mm256_loadu_ps(q.xy + j), qxz = _mm256_loadu_ps(q.xz + j);
+            __m256 qyy = _mm256_loadu_ps(q.yy + j), qyz = _mm256_loadu_ps(q.yz + j), qzz = _mm256_loadu_ps(q.zz + j);
+
+            __m256 qdx = _mm256_fmadd_ps(qxx, dx, _mm256_fmadd_ps(qxy, dy, _mm256_mul_ps(qxz, dz)));
+            __m256 qdy = _mm256_fmadd_ps(qxy, dx, _mm256_fmadd_ps(qyy, dy, _mm256_mul_ps(qyz, dz)));
+            __m256 qdz = _mm256_fmadd_ps(qxz, dx, _mm256_fmadd_ps(qyz, dy, _mm256_mul_ps(qzz, dz)));
+            __m256 dqd = _mm256_fmadd_ps(dx, qdx, _mm256_fmadd_ps(dy, qdy, _mm256_mul_ps(dz, qdz)));
+
+            __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_fmadd_ps(dz, dz, eps)));
+
+            __m256 inv = _mm256_rsqrt_ps(r2);
+            inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(inv, inv), three_halves));
+
+            __m256 inv2 = _mm256_mul_ps(inv, inv);
+            __m256 inv5 = _mm256_mul_ps(_mm256_mul_ps(inv2, inv2), inv);
+            __m256 radial = _mm256_mul_ps(_mm256_mul_ps(five_halves, dqd), inv2);
+
+            ax = _mm256_fmadd_ps(_mm256_fmsub_ps(radial, dx, qdx), inv5, ax);
+            ay = _mm256_fmadd_ps(_mm256_fmsub_ps(radial, dy, qdy), inv5, ay);
+            az = _mm256_fmadd_ps(_mm256_fmsub_ps(radial, dz, qdz), inv5, az);
+
+            if (Potential)
+            {
+                phi = _mm256_fmadd_ps(_mm256_mul_ps(half, dqd), inv5, phi);
+            }
+        }
+
+        float sx = HorizontalSum(ax);
+        float sy = HorizontalSum(ay);
+        float sz = HorizontalSum(az);
+        float sp = Potential ? HorizontalSum(phi) : 0.0f;
+        QuadrupoleTail<Potential>(x, y, z, q, vector_end, source_count, tx[i], ty[i], tz[i], softening, sx, sy, sz, sp);
+        Store<Potential>(out, i, g, sx, sy, sz, sp);
+    }
+}
+
+// adds the two 256-bit halves and reduces those with the AVX2 sum; the
+// halves are moved as doubles since the float extract needs AVX512DQ.
+// Here and for rsqrt14 the zero-masked forms with every lane set give the
+// same result as the plain ones (and the cast, which GCC builds from the
+// plain extract), without the uninitialized merge source GCC warns about.
+NBODY_TARGET_AVX512 static float HorizontalSum(__m512 v)
+{
+    __m512d d = _mm512_castps_pd(v);
+    __m256 lower = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, d, 0));
+    __m256 upper = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xff, d, 1));
+    return HorizontalSum(_mm256_add_ps(lower, upper));
+}
+
+template <bool Potential>
+NBODY_TARGET_AVX512 static void DirectSumAVX512(const float* x, const float* y, const float* z, const float* m, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    const __m512 eps = _mm512_set1_ps(softening);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+
+    for (int t0 = 0; t0 < source_count; t0 += DIRECT_TILE)
+    {
+        int t1 = t0 + DIRECT_TILE < source_count ? t0 + DIRECT_TILE : source_count;
+        int vector_end = t0 + (t1 - t0) / 16 * 16;
+
+        for (int i = begin; i < end; ++i)
+        {
+            const __m512 xi = _mm512_set1_ps(tx[i]);
+            const __m512 yi = _mm512_set1_ps(ty[i]);
+            const __m512 zi = _mm512_set1_ps(tz[i]);
+
+            __m512 ax = _mm512_setzero_ps();
+            __m512 ay = _mm512_setzero_ps();
+            __m512 az = _mm512_setzero_ps();
+            __m512 phi = _mm512_setzero_ps();
+
+            for (int j = t0; j < vector_end; j += 16)
+            {
+                __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + j), xi);
+                __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + j), yi);
+                __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(z + j), zi);
+
+                __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_fmadd_ps(dz, dz, eps)));
+
+                // rsqrt14 is good to 14 bits, one Newton step is enough for float
+                __m512 inv = _mm512_maskz_rsqrt14_ps(0xffff, r2);
+                inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(inv, inv), three_halves));
+
+                __m512 mj = _mm512_loadu_ps(m + j);
+                __m512 s = _mm512_mul_ps(mj, _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv)));
+
+                ax = _mm512_fmadd_ps(dx, s, ax);
+                ay = _mm512_fmadd_ps(dy, s, ay);
+                az = _mm512_fmadd_ps(dz, s, az);
+
+                if (Potential)
+                {
+                    phi = _mm512_fmadd_ps(mj, inv, phi);
+                }
+            }
+
+            float sx = HorizontalSum(ax);
+            float sy = HorizontalSum(ay);
+            float sz = HorizontalSum(az);
+            float sp = Potential ? HorizontalSum(phi) : 0.0f;
+            SumTail<Potential>(x, y, z, m, vector_end, t1, tx[i], ty[i], tz[i], softening, sx, sy, sz, sp);
+            Store<Potential>(out, i, g, sx, sy, sz, sp);
+        }
+    }
+}
+
+#endif
+
+SimdLevel DetectSimdLevel()
+{
+#if defined(NBODY_X86) && defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    bool os_saves_avx = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+    bool fma = (info[2] & (1 << 12)) != 0;
+
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0;
+    bool avx512 = (info[1] & (1 << 16)) != 0 && os_saves_avx && (_xgetbv(0) & 0xe0) == 0xe0;
+
+    if (avx512)
+    {
+        return SimdLevel::AVX512;
+    }
+    if (avx2 && fma && os_saves_avx)
+    {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::SSE;
+#elif defined(NBODY_X86)
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return SimdLevel::AVX2;
+    }
+    return SimdLevel::SSE;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+const char* SimdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::SSE:
+        return "SSE";
+    case SimdLevel::AVX2:
+        return "AVX2";
+    case SimdLevel::AVX512:
+        return "AVX-512";
+    default:
+        return "scalar";
+    }
+}
+
+template <bool Potential>
+static DirectSumFn SelectDirectSum()
+{
+#ifdef NBODY_X86
+    switch (DetectSimdLevel())
+    {
+    case SimdLevel::AVX512:
+        return DirectSumAVX512<Potential>;
+    case SimdLevel::AVX2:
+        return DirectSumAVX2<Potential>;
+    default:
+        return DirectSumSSE<Potential>;
+    }
+#else
+    return DirectSumScalar<Potential>;
+#endif
+}
+
+void DirectSum(const float* x, const float* y, const float* z, const float* m, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    static const DirectSumFn force_kernel = SelectDirectSum<false>();
+    static const DirectSumFn potential_kernel = SelectDirectSum<true>();
+
+    (out.phi ? potential_kernel : force_kernel)(x, y, z, m, source_count, tx, ty, tz, begin, end, out, g, softening);
+}
+
+template <bool Potential>
+static QuadrupoleSumFn SelectQuadrupoleSum()
+{
+#ifdef NBODY_X86
+    // lists are too short for AVX-512 to pay for its wider tail
+    switch (DetectSimdLevel())
+    {
+    case SimdLevel::AVX512:
+    case SimdLevel::AVX2:
+        return QuadrupoleSumAVX2<Potential>;
+    default:
+        return QuadrupoleSumSSE<Potential>;
+    }
+#else
+    return QuadrupoleSumScalar<Potential>;
+#endif
+}
+
+void QuadrupoleSum(const float* x, const float* y, const float* z, QuadrupoleColumns q, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening)
+{
+    static const QuadrupoleSumFn force_kernel = SelectQuadrupoleSum<false>();
+    static const QuadrupoleSumFn potential_kernel = SelectQuadrupoleSum<true>();
+
+    (out.phi ? potential_kernel : force_kernel)(x, y, z, q, source_count, tx, ty, tz, begin, end, out, g, softening);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "gravity.h"
+
+// Instruction sets the direct-summation kernel can run on. The best one the
+// CPU supports is picked the first time DirectSum is called.
+enum class SimdLevel
+{
+    Scalar,
+    SSE,
+    AVX2,
+    AVX512
+};
+
+SimdLevel DetectSimdLevel();
+const char* SimdLevelName(SimdLevel level);
+
+// Adds the acceleration from every source in [0, source_count) to the
+// targets in [begin, end), using the force law in gravity.h:
+//
+//     out.a_i += g * sum_j m_j (r_j - r_i) / (|r_j - r_i|^2 + softening)^(3/2)
+//     out.phi_i -= g * sum_j m_j / sqrt(|r_j - r_i|^2 + softening)
+//
+// softening is the squared softening length (SOFTENING2), and the
+// potential is only summed when out.phi is set. A target that is also a
+// source gets no acceleration from itself, but does get its own
+// -g m / sqrt(softening) in phi, which the caller has to take back out.
+// Zero-mass padding entries contribute nothing, so sources can be a padded
+// ParticleSet column. Any source count works; multiples of 16 avoid the
+// scalar tail.
+void DirectSum(const float* x, const float* y, const float* z, const float* m, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening);
+
+// Columns of traceless quadrupole moments, one entry per source, in the
+// order of BHNode::quadrupole.
+struct QuadrupoleColumns
+{
+    const float* xx, *xy, *xz, *yy, *yz, *zz;
+};
+
+// Adds the quadrupole term of every source in [0, source_count) to the
+// targets in [begin, end); the monopole comes from DirectSum. With d the
+// vector from target to source and r^2 = |d|^2 + softening:
+//
+//     out.a_i += g * sum_j (5/2 (d Q_j d) d / r^7 - Q_j d / r^5)
+//     out.phi_i -= g * sum_j (d Q_j d) / (2 r^5)
+//
+// Zero moments contribute nothing, so the columns can be zero-padded the
+// same way as DirectSum's sources.
+void QuadrupoleSum(const float* x, const float* y, const float* z, QuadrupoleColumns q, int source_count,
+    const float* tx, const float* ty, const float* tz, int begin, int end,
+    AccelOut out, float g, float softening);
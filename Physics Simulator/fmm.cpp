@@ -0,0 +1,613 @@
+#include "fmm.h"
+
+#include "direct_kernel.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+// sink subtrees handed to each thread, so there are enough to balance the load
+const int FMM_TASKS_PER_THREAD = 8;
+
+void FmmSolver::ExpansionOperator::Clear()
+{
+    rows.assign(1, 0);
+    products.clear();
+}
+
+void FmmSolver::ExpansionOperator::Add(int left, int right, double factor)
+{
+    products.push_back(Product{ left, right, factor });
+}
+
+void FmmSolver::ExpansionOperator::EndRow()
+{
+    rows.push_back(static_cast<int>(products.size()));
+}
+
+void FmmSolver::ExpansionOperator::Apply(const double* a, const double* b, double* out) const
+{
+    const int count = static_cast<int>(rows.size()) - 1;
+
+    for (int t = 0; t < count; ++t)
+    {
+        double sum = 0.0;
+        for (int k = rows[t]; k < rows[t + 1]; ++k)
+        {
+            sum += products[k].factor * a[products[k].left] * b[products[k].right];
+        }
+        out[t] += sum;
+    }
+}
+
+FmmSolver::FmmSolver(int order)
+    : theta(0.5f)
+    , leaf_size(64)
+    , order(0)
+{
+    SetOrder(order);
+}
+
+void FmmSolver::SetOrder(int new_order)
+{
+    new_order = std::max(1, std::min(new_order, FMM_MAX_ORDER));
+    if (new_order == order)
+    {
+        return;
+    }
+    order = new_order;
+
+    const int side = order + 1;
+
+    // terms are numbered by degree, so a recurrence over them only ever
+    // looks back at terms it has already filled in
+    exponents.clear();
+    term_index.assign(side * side * side, -1);
+
+    for (int degree = 0; degree <= order; ++degree)
+    {
+        for (int a = degree; a >= 0; --a)
+        {
+            for (int b = degree - a; b >= 0; --b)
+            {
+                int c = degree - a - b;
+                term_index[(a * side + b) * side + c] = static_cast<int>(exponents.size()) / 3;
+                exponents.insert(exponents.end(), { a, b, c });
+            }
+        }
+    }
+
+    const int terms = static_cast<int>(exponents.size()) / 3;
+
+    auto index = [&](int a, int b, int c)
+    {
+        if (a < 0 || b < 0 || c < 0 || a + b + c > order)
+        {
+            return -1;
+        }
+        return term_index[(a * side + b) * side + c];
+    };
+
+    auto degree = [&](int t)
+    {
+        return exponents[3 * t] + exponents[3 * t + 1] + exponents[3 * t + 2];
+    };
+
+    double factorial[FMM_MAX_ORDER + 1] = { 1.0 };
+    for (int k = 1; k <= FMM_MAX_ORDER; ++k)
+    {
+        factorial[k] = factorial[k - 1] * k;
+    }
+
+    inverse_factorial.resize(terms);
+    down_one.resize(3 * terms);
+    recurrence.resize(terms);
+
+    for (int t = 0; t < terms; ++t)
+    {
+        const int* e = &exponents[3 * t];
+        inverse_factorial[t] = 1.0 / (factorial[e[0]] * factorial[e[1]] * factorial[e[2]]);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            int one[3] = { e[0], e[1], e[2] };
+            int two[3] = { e[0], e[1], e[2] };
+            one[axis] -= 1;
+            two[axis] -= 2;
+            const int lower = index(one[0], one[1], one[2]);
+            const int lowest = index(two[0], two[1], two[2]);
+            down_one[3 * t + axis] = lower;
+
+            // see KernelDerivatives
+            const int n = std::max(1, degree(t));
+            Recurrence& r = recurrence[t];
+            r.one[axis] = std::max(0, lower);
+            r.two[axis] = std::max(0, lowest);
+            r.one_factor[axis] = lower >= 0 ? -(2.0 * n - 1.0) * e[axis] / n : 0.0;
+            r.two_factor[axis] = lowest >= 0 ? -(n - 1.0) * e[axis] * (e[axis] - 1) / n : 0.0;
+        }
+    }
+
+    multipole_shift.Clear();
+    multipole_to_local.Clear();
+    local_shift.Clear();
+
+    for (int target = 0; target < terms; ++target)
+    {
+        const int* e = &exponents[3 * target];
+
+        for (int other = 0; other < terms; ++other)
+        {
+            const int* f = &exponents[3 * other];
+
+            // moving a multipole by t: M'_a = sum over k <= a of M_k t^(a-k) / (a-k)!.
+            // About a center of mass the dipole terms vanish, so they are left out
+            int difference = index(e[0] - f[0], e[1] - f[1], e[2] - f[2]);
+            if (difference >= 0 && degree(other) != 1)
+            {
+                multipole_shift.Add(other, difference, inverse_factorial[difference]);
+            }
+
+            // moving a local expansion by s: L'_g = sum over b >= g of L_b s^(b-g) b! / (g! (b-g)!)
+            int excess = index(f[0] - e[0], f[1] - e[1], f[2] - e[2]);
+            if (excess >= 0)
+            {
+                double binomial = inverse_factorial[target] * inverse_factorial[excess] / inverse_factorial[other];
+                local_shift.Add(other, excess, binomial);
+            }
+
+            // a multipole's pull as a local expansion:
+            // L_b = -G / b! sum over a of (-1)^|a| M_a D_(a+b)
+            int sum = index(e[0] + f[0], e[1] + f[1], e[2] + f[2]);
+            if (sum >= 0 && degree(other) != 1)
+            {
+                double sign = degree(other) % 2 == 0 ? 1.0 : -1.0;
+                multipole_to_local.Add(other, sum, -G_CONST * sign * inverse_factorial[target]);
+            }
+        }
+
+        multipole_shift.EndRow();
+        local_shift.EndRow();
+        multipole_to_local.EndRow();
+    }
+}
+
+int FmmSolver::Order() const
+{
+    return order;
+}
+
+void FmmSolver::Powers(glm::vec3 d, double* out) const
+{
+    double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1], pz[FMM_MAX_ORDER + 1];
+    px[0] = py[0] = pz[0] = 1.0;
+
+    for (int k = 1; k <= order; ++k)
+    {
+        px[k] = px[k - 1] * d.x;
+        py[k] = py[k - 1] * d.y;
+        pz[k] = pz[k - 1] * d.z;
+    }
+
+    const int terms = static_cast<int>(inverse_factorial.size());
+    for (int t = 0; t < terms; ++t)
+    {
+        out[t] = px[exponents[3 * t]] * py[exponents[3 * t + 1]] * pz[exponents[3 * t + 2]];
+    }
+}
+
+void FmmSolver::KernelDerivatives(glm::vec3 r, double* out) const
+{
+    // derivatives of 1 / sqrt(|r|^2 + softening), from
+    //     n R^2 D_a = -(2n - 1) sum_i a_i r_i D_(a - e_i) - (n - 1) sum_i a_i (a_i - 1) D_(a - 2 e_i)
+    // with n = |a| and R^2 = |r|^2 + softening
+    const double rx = r.x, ry = r.y, rz = r.z;
+    const double inverse_r2 = 1.0 / (rx * rx + ry * ry + rz * rz + SOFTENING2);
+
+    out[0] = std::sqrt(inverse_r2);
+
+    const int terms = static_cast<int>(recurrence.size());
+    for (int t = 1; t < terms; ++t)
+    {
+        const Recurrence& c = recurrence[t];
+        double sum =
+            c.one_factor[0] * rx * out[c.one[0]] +
+            c.one_factor[1] * ry * out[c.one[1]] +
+            c.one_factor[2] * rz * out[c.one[2]] +
+            c.two_factor[0] * out[c.two[0]] +
+            c.two_factor[1] * out[c.two[1]] +
+            c.two_factor[2] * out[c.two[2]];
+
+        out[t] = sum * inverse_r2;
+    }
+}
+
+void FmmSolver::Upward(const BHTree& tree, ThreadPool* pool)
+{
+    const int count = static_cast<int>(tree.nodes.size());
+    const int terms = static_cast<int>(inverse_factorial.size());
+
+    cells.resize(count);
+    multipoles.assign(static_cast<size_t>(count) * terms, 0.0);
+
+    // the FMM's own copy of the tree, cut off where cells get small enough
+    // to sum directly; cells below that are never looked at
+    leaves.clear();
+    parents.clear();
+    task_stack.assign(1, 0);
+
+    while (!task_stack.empty())
+    {
+        const int node = task_stack.back();
+        task_stack.pop_back();
+
+        const BHNode& n = tree.nodes[node];
+        Cell& cell = cells[node];
+        cell.center = n.center_of_mass;
+        cell.radius = 0.0f;
+        cell.begin = n.begin;
+        cell.end = n.end;
+
+        if (n.first_child >= 0 && n.end - n.begin > leaf_size)
+        {
+            cell.first_child = n.first_child;
+            parents.push_back(node);
+
+            for (int c = n.first_child; c < n.first_child + 8; ++c)
+            {
+                task_stack.push_back(c);
+            }
+        }
+        else
+        {
+            cell.first_child = -1;
+
+            if (n.end > n.begin)
+            {
+                leaves.push_back(node);
+            }
+        }
+    }
+
+    // leaves straight from their bodies; they are independent of each other
+    auto expand = [&](int begin, int end, int thread)
+    {
+        double* powers = scratch[thread].powers.data();
+
+        for (int k = begin; k < end; ++k)
+        {
+            Cell& cell = cells[leaves[k]];
+            double* moments = &multipoles[static_cast<size_t>(leaves[k]) * terms];
+
+            for (int i = cell.begin; i < cell.end; ++i)
+            {
+                glm::vec3 d = glm::vec3(x[i], y[i], z[i]) - cell.center;
+                cell.radius = std::max(cell.radius, glm::length(d));
+
+                Powers(d, powers);
+                for (int t = 0; t < terms; ++t)
+                {
+                    moments[t] += m[i] * powers[t] * inverse_factorial[t];
+                }
+            }
+        }
+    };
+
+    if (pool)
+    {
+        pool->ParallelFor(static_cast<int>(leaves.size()), 64, expand);
+    }
+    else
+    {
+        expand(0, static_cast<int>(leaves.size()), 0);
+    }
+
+    // parents were found before their children, so going backwards every
+    // child is done before its parent
+    double* powers = scratch[0].powers.data();
+
+    for (int k = static_cast<int>(parents.size()) - 1; k >= 0; --k)
+    {
+        const int node = parents[k];
+        Cell& cell = cells[node];
+        double* moments = &multipoles[static_cast<size_t>(node) * terms];
+
+        for (int c = cell.first_child; c < cell.first_child + 8; ++c)
+        {
+            const Cell& child = cells[c];
+            if (child.end <= child.begin)
+            {
+                continue;
+            }
+
+            glm::vec3 shift = child.center - cell.center;
+            cell.radius = std::max(cell.radius, glm::length(shift) + child.radius);
+
+            Powers(shift, powers);
+            multipole_shift.Apply(&multipoles[static_cast<size_t>(c) * terms], powers, moments);
+        }
+    }
+}
+
+void FmmSolver::Interact(int sink, TaskScratch& task, WalkCount& count)
+{
+    const int terms = static_cast<int>(inverse_factorial.size());
+    double* derivatives = task.derivatives.data();
+
+    // dual walk of the sink's subtree against the whole tree. A pair far
+    // enough apart becomes an expansion; otherwise the larger cell is
+    // split, until two leaves are left to sum directly
+    task.pairs.clear();
+    task.pairs.push_back(std::make_pair(sink, 0));
+    task.direct.clear();
+
+    while (!task.pairs.empty())
+    {
+        const int a = task.pairs.back().first;
+        const int b = task.pairs.back().second;
+        task.pairs.pop_back();
+
+        const Cell& A = cells[a];
+        const Cell& B = cells[b];
+
+        glm::vec3 r = A.center - B.center;
+
+        if (A.radius + B.radius < theta * glm::length(r))
+        {
+            KernelDerivatives(r, derivatives);
+            multipole_to_local.Apply(&multipoles[static_cast<size_t>(b) * terms], derivatives,
+                &locals[static_cast<size_t>(a) * terms]);
+
+            ++count.nodes;
+            continue;
+        }
+
+        if (A.first_child < 0 && B.first_child < 0)
+        {
+            task.direct.push_back(std::make_pair(a, b));
+            count.bodies += (A.end - A.begin) * (B.end - B.begin);
+            continue;
+        }
+
+        // empty cells are dropped here rather than after being popped
+        if (B.first_child < 0 || (A.first_child >= 0 && A.radius >= B.radius))
+        {
+            for (int c = A.first_child; c < A.first_child + 8; ++c)
+            {
+                if (cells[c].end > cells[c].begin)
+                {
+                    task.pairs.push_back(std::make_pair(c, b));
+                }
+            }
+        }
+        else
+        {
+            for (int c = B.first_child; c < B.first_child + 8; ++c)
+            {
+                if (cells[c].end > cells[c].begin)
+                {
+                    task.pairs.push_back(std::make_pair(a, c));
+                }
+            }
+        }
+    }
+}
+
+void FmmSolver::SumDirect(AccelOut sorted, TaskScratch& task)
+{
+    // leaf pairs are short runs of bodies; gathering all of a sink's
+    // sources into one padded list lets the kernel run whole vectors
+    std::sort(task.direct.begin(), task.direct.end());
+
+    for (size_t k = 0; k < task.direct.size();)
+    {
+        const int a = task.direct[k].first;
+
+        task.sx.clear();
+        task.sy.clear();
+        task.sz.clear();
+        task.sm.clear();
+
+        for (; k < task.direct.size() && task.direct[k].first == a; ++k)
+        {
+            const Cell& B = cells[task.direct[k].second];
+            task.sx.insert(task.sx.end(), x.begin() + B.begin, x.begin() + B.end);
+            task.sy.insert(task.sy.end(), y.begin() + B.begin, y.begin() + B.end);
+            task.sz.insert(task.sz.end(), z.begin() + B.begin, z.begin() + B.end);
+            task.sm.insert(task.sm.end(), m.begin() + B.begin, m.begin() + B.end);
+        }
+
+        size_t padded = (task.sm.size() + PARTICLE_PADDING - 1) / PARTICLE_PADDING * PARTICLE_PADDING;
+        task.sx.resize(padded, 0.0f);
+        task.sy.resize(padded, 0.0f);
+        task.sz.resize(padded, 0.0f);
+        task.sm.resize(padded, 0.0f);
+
+        const Cell& A = cells[a];
+        DirectSum(task.sx.data(), task.sy.data(), task.sz.data(), task.sm.data(), static_cast<int>(padded),
+            x.data(), y.data(), z.data(), A.begin, A.end, sorted, G_CONST, SOFTENING2);
+    }
+}
+
+void FmmSolver::Downward(int sink, AccelOut sorted, TaskScratch& task)
+{
+    const int terms = static_cast<int>(inverse_factorial.size());
+    double* powers = task.powers.data();
+
+    // parents are finished before their children are popped
+    task.stack.assign(1, sink);
+
+    while (!task.stack.empty())
+    {
+        const int node = task.stack.back();
+        task.stack.pop_back();
+
+        const Cell& cell = cells[node];
+        const double* local = &locals[static_cast<size_t>(node) * terms];
+
+        if (cell.first_child >= 0)
+        {
+            for (int c = cell.first_child; c < cell.first_child + 8; ++c)
+            {
+                if (cells[c].end <= cells[c].begin)
+                {
+                    continue;
+                }
+
+                Powers(cells[c].center - cell.center, powers);
+                local_shift.Apply(local, powers, &locals[static_cast<size_t>(c) * terms]);
+
+                task.stack.push_back(c);
+            }
+            continue;
+        }
+
+        // the local expansion at each body: its value is the potential and
+        // minus its gradient the acceleration
+        for (int i = cell.begin; i < cell.end; ++i)
+        {
+            Powers(glm::vec3(x[i], y[i], z[i]) - cell.center, powers);
+
+            double potential = local[0];
+            double gradient[3] = { 0.0, 0.0, 0.0 };
+
+            for (int t = 1; t < terms; ++t)
+            {
+                potential += local[t] * powers[t];
+
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    int lower = down_one[3 * t + axis];
+                    if (lower >= 0)
+                    {
+                        gradient[axis] += exponents[3 * t + axis] * local[t] * powers[lower];
+                    }
+                }
+            }
+
+            sorted.ax[i] -= static_cast<float>(gradient[0]);
+            sorted.ay[i] -= static_cast<float>(gradient[1]);
+            sorted.az[i] -= static_cast<float>(gradient[2]);
+
+            if (sorted.phi)
+            {
+                sorted.phi[i] += static_cast<float>(potential);
+            }
+        }
+    }
+}
+
+WalkCount FmmSolver::Evaluate(const BHTree& tree, ParticleView particles, AccelOut out, ThreadPool* pool)
+{
+    const int n = static_cast<int>(particles.Size());
+    const int terms = static_cast<int>(inverse_factorial.size());
+    const int threads = pool ? pool->ThreadCount() : 1;
+
+    WalkCount total{ 0, 0 };
+    if (n == 0)
+    {
+        return total;
+    }
+
+    scratch.resize(threads);
+    for (TaskScratch& task : scratch)
+    {
+        task.derivatives.resize(terms);
+        task.powers.resize(terms);
+    }
+
+    // bodies in Morton order, so that every node's bodies are one
+    // contiguous run the direct kernel can take as it is
+    for (AlignedVector<float>* column : { &x, &y, &z, &m, &ax, &ay, &az, &phi })
+    {
+        column->resize(n);
+    }
+
+    auto gather = [&](int begin, int end, int)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            int b = tree.order[i];
+            x[i] = particles.x[b];
+            y[i] = particles.y[b];
+            z[i] = particles.z[b];
+            m[i] = particles.m[b];
+            ax[i] = ay[i] = az[i] = phi[i] = 0.0f;
+        }
+    };
+
+    if (pool)
+    {
+        pool->ParallelFor(n, 4096, gather);
+    }
+    else
+    {
+        gather(0, n, 0);
+    }
+
+    Upward(tree, pool);
+    locals.assign(multipoles.size(), 0.0);
+
+    // every task is a subtree that only its own thread writes to, from its
+    // interactions down to its bodies. No task is smaller than leaf_size,
+    // so none starts below a cell that is summed directly
+    tree.FindGroups(std::max(leaf_size, n / (FMM_TASKS_PER_THREAD * threads)), tasks);
+
+    AccelOut sorted{ ax.data(), ay.data(), az.data(), out.phi ? phi.data() : nullptr };
+    std::vector<WalkCount> counts(threads, WalkCount{ 0, 0 });
+
+    auto run = [&](int begin, int end, int thread)
+    {
+        for (int k = begin; k < end; ++k)
+        {
+            Interact(tasks[k], scratch[thread], counts[thread]);
+            SumDirect(sorted, scratch[thread]);
+            Downward(tasks[k], sorted, scratch[thread]);
+        }
+    };
+
+    if (pool)
+    {
+        pool->ParallelFor(static_cast<int>(tasks.size()), 1, run);
+    }
+    else
+    {
+        run(0, static_cast<int>(tasks.size()), 0);
+    }
+
+    // back to body order; every body met itself in its own leaf, which
+    // the direct kernel counts in the potential
+    const float self_potential = G_CONST / sqrt(SOFTENING2);
+
+    auto scatter = [&](int begin, int end, int)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            int b = tree.order[i];
+            out.ax[b] = ax[i];
+            out.ay[b] = ay[i];
+            out.az[b] = az[i];
+
+            if (out.phi)
+            {
+                out.phi[b] = phi[i] + self_potential * m[i];
+            }
+        }
+    };
+
+    if (pool)
+    {
+        pool->ParallelFor(n, 4096, scatter);
+    }
+    else
+    {
+        scatter(0, n, 0);
+    }
+
+    for (const WalkCount& c : counts)
+    {
+        total.nodes += c.nodes;
+        total.bodies += c.bodies;
+    }
+    return total;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "bhtree.h"
+#include "gravity.h"
+#include "particle_set.h"
+
+#include <utility>
+#include <vector>
+
+class ThreadPool;
+
+// highest expansion order SetOrder accepts
+const int FMM_MAX_ORDER = 8;
+
+// Fast multipole solver on the Barnes-Hut octree, with Cartesian Taylor
+// expansions about each cell's center of mass. Cells far enough apart
+// interact through their expansions (M2L) instead of body by body, and the
+// local expansions are passed down the tree to the bodies, so the work per
+// body no longer grows with log N as it does in a tree walk. Leaves close
+// to each other are summed with the direct kernel.
+class FmmSolver
+{
+public:
+    explicit FmmSolver(int order = 4);
+
+    // keeps every term up to total degree order in both the multipole and
+    // the local expansions, 1..FMM_MAX_ORDER. Higher orders are more
+    // accurate and cost more per cell pair
+    void SetOrder(int order);
+    int Order() const;
+
+    // cells interact through their expansions when their radii add up to
+    // less than theta times the distance between their centers of mass
+    float theta;
+
+    // cells with at most this many bodies are summed directly when they
+    // are too close for expansions, instead of being split further
+    int leaf_size;
+
+    // Stores the acceleration, and the potential when out.phi is set, on
+    // every body, using the force law in gravity.h. tree has to be built
+    // from particles with BuildMorton. Returns the cell pairs that used
+    // expansions in nodes and the body pairs summed directly in bodies.
+    WalkCount Evaluate(const BHTree& tree, ParticleView particles, AccelOut out, ThreadPool* pool = nullptr);
+
+private:
+    // A linear operator between expansions, out[t] += sum of factor *
+    // a[left] * b[right] over the products in row t. Each row is summed on
+    // its own before it is stored, so no product waits on the one before.
+    struct ExpansionOperator
+    {
+        struct Product
+        {
+            int left, right;
+            double factor;
+        };
+
+        std::vector<int> rows;
+        std::vector<Product> products;
+
+        void Clear();
+        void Add(int left, int right, double factor);
+        void EndRow();
+        void Apply(const double* a, const double* b, double* out) const;
+    };
+
+    // per-thread buffers for the interaction pass: cell pairs still to
+    // look at, leaf pairs to sum directly, and each sink leaf's sources
+    // gathered for the kernel
+    struct TaskScratch
+    {
+        std::vector<double> derivatives;
+        std::vector<double> powers;
+        std::vector<std::pair<int, int>> pairs;
+        std::vector<std::pair<int, int>> direct;
+        std::vector<int> stack;
+        AlignedVector<float> sx, sy, sz, sm;
+    };
+
+    // What the walks need of a tree node, kept small so that a dual walk
+    // jumping around the tree touches as few cache lines as possible.
+    // first_child is -1 for cells summed directly, even if the tree goes on.
+    struct Cell
+    {
+        glm::vec3 center;
+        float radius;
+        int first_child;
+        int begin, end;
+    };
+
+    void Upward(const BHTree& tree, ThreadPool* pool);
+    // the interactions of one sink subtree, then its locals down to its bodies
+    void Interact(int sink, TaskScratch& task, WalkCount& count);
+    void SumDirect(AccelOut sorted, TaskScratch& task);
+    void Downward(int sink, AccelOut sorted, TaskScratch& task);
+
+    void Powers(glm::vec3 d, double* out) const;
+    void KernelDerivatives(glm::vec3 r, double* out) const;
+
+    int order;
+    // terms of degree <= order, as exponents of x, y and z, lowest degree first
+    std::vector<int> exponents;
+    std::vector<int> term_index;
+    std::vector<double> inverse_factorial;
+    // each term with one power of every axis taken off, or -1
+    std::vector<int> down_one;
+    // the derivative recurrence as three terms per axis: which earlier
+    // derivatives it reads (0 where the factor is 0) and their factors
+    struct Recurrence
+    {
+        int one[3], two[3];
+        double one_factor[3], two_factor[3];
+    };
+    std::vector<Recurrence> recurrence;
+    ExpansionOperator multipole_shift;
+    ExpansionOperator multipole_to_local;
+    ExpansionOperator local_shift;
+
+    // per node: the cell, then the expansion coefficients about its
+    // center of mass, one entry per term each
+    std::vector<Cell> cells;
+    std::vector<int> leaves;
+    std::vector<int> parents;
+    std::vector<int> task_stack;
+    std::vector<double> multipoles;
+    std::vector<double> locals;
+
+    // bodies in Morton order and their results
+    AlignedVector<float> x, y, z, m;
+    AlignedVector<float> ax, ay, az, phi;
+
+    std::vector<int> tasks;
+    std::vector<TaskScratch> scratch;
+};
@@ -6,11 +6,13 @@
 ** Creative Commons, either version 4 of the License, or (at your
 ** option) any later version.
 ******************************************************************/
-#include "body.h"
 #include "game.h"
-#include "bhtree.h"
+#include "checkpoint.h"
+#include "initial_conditions.h"
+#include "instance_renderer.h"
+#include "physics_thread.h"
 #include "resource_manager.h"
-#include "sprite_renderer.h"
+#include "simulation.h"
 
 #include <glm/gtx/norm.hpp>
 #include <glm/gtc/random.hpp>
@@ -21,14 +23,56 @@
 #include <queue>
 #include <math.h>
 #include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 
 // Game-related State data
-SpriteRenderer* Renderer;
-std::vector<Body> Bodies;
+InstanceRenderer* Renderer;
+Simulation* Sim;
+PhysicsThread* Physics;
+// snapshot shown this frame, taken once per Update
+const ParticleSnapshot* Frame;
 
 const int BODY_COUNT = 10000;
-const float G_CONST = 6.67e-3;
-const float E_CONST = 1e-20;
+
+// starting setup by its model name (see initial_conditions.h), with 5 mass
+// units per body; the NBODY_IC environment variable overrides it
+const char* INITIAL_CONDITIONS = "plummer";
+const uint64_t INITIAL_SEED = 1;
+
+// threads used for physics (0 = all hardware threads)
+const int WORKER_COUNT = 0;
+
+// the state is saved here every CHECKPOINT_EVERY physics steps and when
+// the window closes, and picked up again on the next start unless the
+// NBODY_RESUME environment variable is 0, in which case the run starts
+// fresh and saves over it. A checkpoint that cannot be read is moved to
+// CHECKPOINT_PATH.bad before anything is saved
+const char* CHECKPOINT_PATH = "nbody.ckpt";
+const long long CHECKPOINT_EVERY = 3600;
+
+// force calculation by its registry name (see gravity_solver.h); the
+// NBODY_SOLVER environment variable overrides it without a rebuild
+const char* GRAVITY_SOLVER = "bh";
+
+// simulated time per physics step, and simulated time per second on screen;
+// together they give 60 physics steps a second whatever the frame rate
+const float PHYSICS_DT = 0.25f;
+const float SIMULATION_SPEED = 15.0f;
+
+// true if nothing is at path, as opposed to a file that cannot be read
+static bool FileMissing(const char* path)
+{
+    FILE* file = std::fopen(path, "rb");
+    if (file)
+    {
+        std::fclose(file);
+        return false;
+    }
+    return errno == ENOENT;
+}
 
 int ballId = 0;
 int prev, after;
@@ -58,94 +102,103 @@ Game::Game(unsigned int width, unsigned int height)
 
 Game::~Game()
 {
+    delete Physics;
     delete Renderer;
+    delete Sim;
 }
 
 void Game::Init()
 {
     // load shaders
-    ResourceManager::LoadShader("shaders/sprite.vs", "shaders/sprite.frag", nullptr, "sprite");
+    ResourceManager::LoadShader("shaders/instanced.vs", "shaders/sprite.frag", nullptr, "instanced");
     // configure shaders
     AspectRatio = static_cast<float>(this->Width) / static_cast<float>(this->Height);
     glm::mat4 projection = glm::perspective(FOV, AspectRatio, 0.01f, 10000.0f);
-    ResourceManager::GetShader("sprite").Use().SetInteger("image", 0);
-    ResourceManager::GetShader("sprite").SetMatrix4("projection", projection);
+    ResourceManager::GetShader("instanced").Use().SetInteger("image", 0);
+    ResourceManager::GetShader("instanced").SetMatrix4("projection", projection);
     // set render-specific controls
-    Shader shader = ResourceManager::GetShader("sprite");
-    Renderer = new SpriteRenderer(shader);
+    Shader shader = ResourceManager::GetShader("instanced");
+    Renderer = new InstanceRenderer(shader, BODY_COUNT);
+    Sim = new Simulation(WORKER_COUNT);
+
+    const char* solver = std::getenv("NBODY_SOLVER");
+    if (!solver || !Sim->SetSolver(solver))
+    {
+        if (solver)
+        {
+            std::cout << "unknown solver " << solver << ", using " << GRAVITY_SOLVER << std::endl;
+        }
+        Sim->SetSolver(GRAVITY_SOLVER);
+    }
     // load textures
     ResourceManager::LoadTexture("textures/eden_ball3d.png", true, "body");
 
     // BIG CHUNGUS PLANET 
-    // Bodies.emplace_back(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0, 0.0f, 0.0f), 1000.0f, ResourceManager::GetTexture("body"));
+    // Sim->Particles.Add(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0, 0.0f, 0.0f), 1000.0f);
     
-    for (int i = 0; i < BODY_COUNT; ++i) {
-        Bodies.emplace_back(glm::sphericalRand(1000.0f), glm::vec3(0.0f, 0.0f, 0.0f), 5.0f, ResourceManager::GetTexture("body"));
-    }
-}
+    CheckpointInfo resumed{ 0, 0.0 };
+    std::string error;
 
-void Game::Update(float dt)
-{
-    if (!Paused && !Transitioning)
-    {
-        UpdateBarnesHut(dt);
+    const char* resume = std::getenv("NBODY_RESUME");
+    bool restored = false;
+    bool save_checkpoints = true;
 
-    }
-
-    CenterProjection(dt);
-}
- 
-void Game::UpdateBruteForce(float dt)
-{
-    for (int i = 0; i < Bodies.size(); ++i)
+    if ((!resume || std::strcmp(resume, "0") != 0) && !FileMissing(CHECKPOINT_PATH))
     {
-        for (int j = i + 1; j < Bodies.size(); ++j)
+        restored = ReadCheckpoint(CHECKPOINT_PATH, Sim->Particles, resumed, error);
+        if (!restored)
         {
-            float F = G_CONST * Bodies[i].Mass * Bodies[j].Mass /
-                sqrt(glm::distance2(Bodies[i].Position, Bodies[j].Position) + E_CONST);
+            // saving over it would lose whatever the file still holds
+            std::string aside = std::string(CHECKPOINT_PATH) + ".bad";
+            std::cout << "cannot resume: " << error << std::endl;
 
-            glm::vec3 Direction = glm::normalize(Bodies[i].Position - Bodies[j].Position);
-
-            Bodies[i].Velocity -= Direction * F / Bodies[i].Mass;
-            Bodies[j].Velocity += Direction * F / Bodies[j].Mass;
+            if (std::rename(CHECKPOINT_PATH, aside.c_str()) == 0)
+            {
+                std::cout << "moved it to " << aside << ", starting fresh" << std::endl;
+            }
+            else
+            {
+                std::cout << "cannot move it to " << aside << ", starting fresh without checkpoints" << std::endl;
+                save_checkpoints = false;
+            }
         }
     }
 
-    for (int i = 0; i < Bodies.size(); ++i)
+    if (!restored)
     {
-        Bodies[i].Position += Bodies[i].Velocity * dt;
-    }
-}
-
-
-void Game::UpdateBarnesHut(float dt)
-{
-    float min_coord = 0, max_coord = 0;
+        InitialConditionsOptions ic;
+        ic.count = BODY_COUNT;
+        ic.seed = INITIAL_SEED;
+        ic.total_mass = 5.0f * BODY_COUNT;
 
-    for (Body& body : Bodies)
-    {
-        min_coord = std::min({ min_coord, body.Position.x, body.Position.y,  body.Position.z });
-        max_coord = std::max({ max_coord, body.Position.x, body.Position.y,  body.Position.z });
+        const char* model = std::getenv("NBODY_IC");
+        if (!model || !GenerateInitialConditions(model, Sim->Particles, ic, Sim->Pool()))
+        {
+            if (model)
+            {
+                std::cout << "unknown initial conditions " << model << ", using " << INITIAL_CONDITIONS << std::endl;
+            }
+            GenerateInitialConditions(INITIAL_CONDITIONS, Sim->Particles, ic, Sim->Pool());
+        }
     }
 
-    float length = std::max(abs(min_coord), max_coord) + 69.0f;
-
-    BHTree root(Oct{ glm::vec3(0.0f, 0.0f, 0.0f), length} );
-
-    for (auto& body : Bodies)
+    // from here on only the physics thread touches Sim
+    Physics = new PhysicsThread(*Sim, PHYSICS_DT, SIMULATION_SPEED);
+    if (save_checkpoints)
     {
-        root.Insert(&body);
+        Physics->SetCheckpoint(CHECKPOINT_PATH, CHECKPOINT_EVERY);
     }
+    Physics->SetStepCount(static_cast<long long>(resumed.step));
+    Physics->Start();
+    Frame = &Physics->Latest();
+}
 
-    for (auto& body : Bodies)
-    {
-        root.UpdateForce(&body);
-    }
+void Game::Update(float dt)
+{
+    Physics->SetPaused(Paused || Transitioning);
+    Frame = &Physics->Latest();
 
-    for (auto& body : Bodies)
-    {
-        body.Position += body.Velocity * dt;
-    }
+    CenterProjection(dt);
 }
 
 
@@ -157,10 +210,8 @@ void Game::ProcessInput()
 
 void Game::Render()
 {
-    for (int i = 0; i < Bodies.size(); ++i)
-    {
-        Bodies[i].Draw(*Renderer);
-    }
+    Texture2D texture = ResourceManager::GetTexture("body");
+    Renderer->DrawInstances(texture, Frame->instances.data(), static_cast<unsigned int>(Frame->count));
 }
 
 
@@ -216,7 +267,7 @@ void Game::CenterProjection(float dt)
     }
     else 
     {
-        target = Bodies[ballId].Position;
+        target = Frame->Position(ballId);
     }
 
     target = glm::vec3(0.0f, 0.0f, 0.0f);
@@ -230,7 +281,7 @@ void Game::CenterProjection(float dt)
     );
 
    
-    ResourceManager::GetShader("sprite").SetMatrix4("view", view);
+    ResourceManager::GetShader("instanced").SetMatrix4("view", view);
 }
 
 void Game::Transition(int prev, int after) 
@@ -240,8 +291,8 @@ void Game::Transition(int prev, int after)
     TransitionProgress = 0.0f;
 
 
-    Start = Bodies[prev].Position;
-    End = Bodies[after].Position;
+    Start = Frame->Position(prev);
+    End = Frame->Position(after);
 
     if (Start.z > End.z) 
     {
@@ -263,12 +314,12 @@ void Game::HandleKeyEvent(GLFWwindow* window, int key, int scancode, int action,
     {
         if (key == GLFW_KEY_A)
         {
-            Transition(ballId, ballId == 0 ? Bodies.size() - 1 : ballId - 1);
+            Transition(ballId, ballId == 0 ? Frame->count - 1 : ballId - 1);
 
         }
         if (key == GLFW_KEY_D)
         {
-            Transition(ballId, (ballId + 1) % Bodies.size());
+            Transition(ballId, (ballId + 1) % Frame->count);
 
         }
         if (key == GLFW_KEY_1)
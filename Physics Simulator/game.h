@@ -44,8 +44,6 @@ public:
     // game loop
     void ProcessInput();
     void Update(float dt);
-    void UpdateBruteForce(float dt);
-    void UpdateBarnesHut(float dt);
     void Render();
 
     void CenterProjection(float dt);
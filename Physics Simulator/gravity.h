@@ -0,0 +1,26 @@
+#pragma once
+
+// Force law shared by every solver: Newtonian gravity with Plummer
+// softening,
+//
+//     a_i = G_CONST * sum_j m_j (r_j - r_i) / (|r_j - r_i|^2 + SOFTENING2)^(3/2)
+//
+// Softening keeps close encounters finite, so a fixed timestep can pass
+// through them without blowing up.
+
+// gravitational constant in simulation units
+const float G_CONST = 1.0f;
+// Plummer softening length and its square, which is what the kernels use
+const float SOFTENING = 1.0f;
+const float SOFTENING2 = SOFTENING * SOFTENING;
+
+// Caller-owned arrays that a force evaluation writes into, indexed like its
+// targets. phi may be null when the potential is not wanted; the other
+// three must always be set.
+struct AccelOut
+{
+    float* ax;
+    float* ay;
+    float* az;
+    float* phi;
+};
@@ -0,0 +1,385 @@
+#include "gravity_solver.h"
+
+#include "direct_kernel.h"
+#include "profiler.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <math.h>
+
+// how many bodies each thread grabs at a time in the force passes
+const int FORCE_CHUNK = 64;
+
+// Runs body(begin, end, thread) over [0, count) on pool, or on the calling
+// thread alone without one.
+template <typename Body>
+static void ForEachChunk(ThreadPool* pool, int count, int chunk, Body body)
+{
+    if (pool)
+    {
+        pool->ParallelFor(count, chunk, body);
+    }
+    else
+    {
+        body(0, count, 0);
+    }
+}
+
+GravitySolver::~GravitySolver()
+{
+}
+
+const int* GravitySolver::BodyOrder() const
+{
+    return nullptr;
+}
+
+bool GravitySolver::SetOption(const std::string&, float)
+{
+    return false;
+}
+
+template <typename T>
+static std::unique_ptr<GravitySolver> Create(ThreadPool* pool)
+{
+    return std::unique_ptr<GravitySolver>(new T(pool));
+}
+
+// built on first use, so that registering from another file's static
+// initializer cannot run before it exists
+static std::vector<GravitySolverInfo>& Registry()
+{
+    static std::vector<GravitySolverInfo> registry = {
+        { "direct", "every pair with the direct kernel, O(N^2)", Create<DirectGravity> },
+        { "bh", "Barnes-Hut tree walk; options theta, leaf, group, quadrupole", Create<BarnesHutGravity> },
+        { "fmm", "fast multipole method; options order and theta, plus the bh ones for its tree", Create<FmmGravity> },
+    };
+    return registry;
+}
+
+void RegisterGravitySolver(const std::string& name, const std::string& description, GravitySolverFactory create)
+{
+    std::vector<GravitySolverInfo>& registry = Registry();
+
+    for (GravitySolverInfo& info : registry)
+    {
+        if (info.name == name)
+        {
+            info.description = description;
+            info.create = create;
+            return;
+        }
+    }
+
+    registry.push_back(GravitySolverInfo{ name, description, create });
+}
+
+const std::vector<GravitySolverInfo>& GravitySolvers()
+{
+    return Registry();
+}
+
+std::unique_ptr<GravitySolver> CreateGravitySolver(const std::string& name, ThreadPool* pool)
+{
+    for (const GravitySolverInfo& info : Registry())
+    {
+        if (info.name == name)
+        {
+            return info.create(pool);
+        }
+    }
+
+    return nullptr;
+}
+
+DirectGravity::DirectGravity(ThreadPool* pool)
+    : pool(pool)
+{
+}
+
+void DirectGravity::ComputeAccelerations(ParticleView particles, AccelOut out)
+{
+    const int n = static_cast<int>(particles.Size());
+    const int sources = static_cast<int>(particles.PaddedSize());
+
+    const float* x = particles.x;
+    const float* y = particles.y;
+    const float* z = particles.z;
+    const float* m = particles.m;
+
+    NBODY_PROFILE_SCOPE(Phase::Force);
+
+    // every body sums the pull of all others on its own, so bodies split
+    // across threads without sharing any writes
+    ForEachChunk(pool, n, FORCE_CHUNK, [&](int begin, int end, int)
+    {
+        std::fill(out.ax + begin, out.ax + end, 0.0f);
+        std::fill(out.ay + begin, out.ay + end, 0.0f);
+        std::fill(out.az + begin, out.az + end, 0.0f);
+
+        if (out.phi)
+        {
+            // the kernel counts every body in its own potential; start from
+            // minus that so it cancels
+            for (int i = begin; i < end; ++i)
+            {
+                out.phi[i] = G_CONST * m[i] / sqrt(SOFTENING2);
+            }
+        }
+
+        DirectSum(x, y, z, m, sources, x, y, z, begin, end, out, G_CONST, SOFTENING2);
+    });
+
+    NBODY_PROFILE_ADD(ProfileCounter::BodyBodyInteractions, static_cast<long long>(n) * (n - 1));
+}
+
+void DirectGravity::ComputeAccelerations(ParticleView particles, const int* targets, int count, AccelOut out)
+{
+    NBODY_PROFILE_SCOPE(Phase::Force);
+
+    const int sources = static_cast<int>(particles.PaddedSize());
+
+    for (AlignedVector<float>* column : { &gather_x, &gather_y, &gather_z, &gather_ax, &gather_ay, &gather_az })
+    {
+        column->resize(count);
+    }
+    if (out.phi)
+    {
+        gather_phi.resize(count);
+    }
+
+    // the kernel wants its targets in contiguous arrays, so copy them
+    // out, sum, and copy the results back
+    ForEachChunk(pool, count, FORCE_CHUNK, [&](int begin, int end, int)
+    {
+        for (int k = begin; k < end; ++k)
+        {
+            gather_x[k] = particles.x[targets[k]];
+            gather_y[k] = particles.y[targets[k]];
+            gather_z[k] = particles.z[targets[k]];
+            gather_ax[k] = gather_ay[k] = gather_az[k] = 0.0f;
+
+            // each target is also a source, cancelled as in the full sum
+            if (out.phi)
+            {
+                gather_phi[k] = G_CONST * particles.m[targets[k]] / sqrt(SOFTENING2);
+            }
+        }
+
+        DirectSum(particles.x, particles.y, particles.z, particles.m, sources,
+            gather_x.data(), gather_y.data(), gather_z.data(), begin, end,
+            AccelOut{ gather_ax.data(), gather_ay.data(), gather_az.data(), out.phi ? gather_phi.data() : nullptr },
+            G_CONST, SOFTENING2);
+
+        for (int k = begin; k < end; ++k)
+        {
+            out.ax[targets[k]] = gather_ax[k];
+            out.ay[targets[k]] = gather_ay[k];
+            out.az[targets[k]] = gather_az[k];
+            if (out.phi)
+            {
+                out.phi[targets[k]] = gather_phi[k];
+            }
+        }
+    });
+
+    NBODY_PROFILE_ADD(ProfileCounter::BodyBodyInteractions, static_cast<long long>(count) * (particles.Size() - 1));
+}
+
+BarnesHutGravity::BarnesHutGravity(ThreadPool* pool)
+    : build(TreeBuild::Morton)
+    , group_size(32)
+    , pool(pool)
+{
+}
+
+void BarnesHutGravity::ComputeAccelerations(ParticleView particles, AccelOut out)
+{
+    const int n = static_cast<int>(particles.Size());
+
+    BuildTree(particles, build);
+
+    if (build == TreeBuild::Morton && group_size > 0)
+    {
+        WalkGroups(particles, out);
+    }
+    else
+    {
+        WalkTree(particles, build == TreeBuild::Morton ? tree.order.data() : nullptr, n, out);
+    }
+}
+
+void BarnesHutGravity::ComputeAccelerations(ParticleView particles, const int* targets, int count, AccelOut out)
+{
+    {
+        NBODY_PROFILE_SCOPE(Phase::TreeBuild);
+        tree.Refit(particles);
+    }
+
+    WalkTree(particles, targets, count, out);
+}
+
+const int* BarnesHutGravity::BodyOrder() const
+{
+    return build == TreeBuild::Morton && !tree.order.empty() ? tree.order.data() : nullptr;
+}
+
+bool BarnesHutGravity::SetOption(const std::string& name, float value)
+{
+    if (name == "theta")
+    {
+        tree.theta = value;
+    }
+    else if (name == "leaf")
+    {
+        tree.leaf_capacity = std::max(1, static_cast<int>(value));
+    }
+    else if (name == "group")
+    {
+        group_size = std::max(0, static_cast<int>(value));
+    }
+    else if (name == "quadrupole")
+    {
+        tree.quadrupole = value != 0.0f;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+void BarnesHutGravity::BuildTree(ParticleView particles, TreeBuild how)
+{
+    const int n = static_cast<int>(particles.Size());
+
+    float min_coord = 0, max_coord = 0;
+
+    {
+        NBODY_PROFILE_SCOPE(Phase::Bounds);
+
+        for (int i = 0; i < n; ++i)
+        {
+            min_coord = std::min({ min_coord, particles.x[i], particles.y[i], particles.z[i] });
+            max_coord = std::max({ max_coord, particles.x[i], particles.y[i], particles.z[i] });
+        }
+    }
+
+    // the root is centered on the origin, so it has to span twice the largest coordinate
+    float length = 2.0f * (std::max(abs(min_coord), max_coord) + 69.0f);
+
+    Oct bounds{ glm::vec3(0.0f, 0.0f, 0.0f), length };
+
+    {
+        NBODY_PROFILE_SCOPE(Phase::TreeBuild);
+
+        if (how == TreeBuild::Morton)
+        {
+            tree.BuildMorton(bounds, particles, pool);
+        }
+        else
+        {
+            tree.Reset(bounds);
+
+            for (int i = 0; i < n; ++i)
+            {
+                tree.Insert(particles, i);
+            }
+
+            // Insert leaves the quadrupoles out
+            tree.Refit(particles);
+        }
+    }
+
+    NBODY_PROFILE_SET(ProfileCounter::NodesAllocated, static_cast<long long>(tree.nodes.size()));
+    NBODY_PROFILE_SET(ProfileCounter::TreeDepth, tree.Depth());
+}
+
+void BarnesHutGravity::WalkGroups(ParticleView particles, AccelOut out)
+{
+    NBODY_PROFILE_SCOPE(Phase::Force);
+
+    tree.FindGroups(group_size, groups);
+    group_buffers.resize(pool ? pool->ThreadCount() : 1);
+
+    // groups cover disjoint bodies, so they are independent like single walks
+    ForEachChunk(pool, static_cast<int>(groups.size()), 1, [&](int begin, int end, int thread)
+    {
+        long long node_count = 0;
+        long long body_count = 0;
+
+        for (int g = begin; g < end; ++g)
+        {
+            WalkCount walk = tree.EvaluateGroup(particles, groups[g], out, group_buffers[thread]);
+            node_count += walk.nodes;
+            body_count += walk.bodies;
+        }
+
+        NBODY_PROFILE_ADD(ProfileCounter::BodyNodeInteractions, node_count);
+        NBODY_PROFILE_ADD(ProfileCounter::BodyBodyInteractions, body_count);
+    });
+}
+
+void BarnesHutGravity::WalkTree(ParticleView particles, const int* bodies, int count, AccelOut out)
+{
+    NBODY_PROFILE_SCOPE(Phase::Force);
+
+    // the tree is read-only here and every body only writes its own
+    // acceleration, so bodies can be walked in parallel. In Morton order each
+    // chunk is a compact region, which keeps consecutive walks on the same nodes
+    ForEachChunk(pool, count, FORCE_CHUNK, [&](int begin, int end, int)
+    {
+        long long node_count = 0;
+        long long body_count = 0;
+
+        for (int i = begin; i < end; ++i)
+        {
+            int b = bodies ? bodies[i] : i;
+            WalkCount walk = tree.Evaluate(particles, particles.Position(b), b, out, b);
+            node_count += walk.nodes;
+            body_count += walk.bodies;
+        }
+
+        NBODY_PROFILE_ADD(ProfileCounter::BodyNodeInteractions, node_count);
+        NBODY_PROFILE_ADD(ProfileCounter::BodyBodyInteractions, body_count);
+    });
+}
+
+FmmGravity::FmmGravity(ThreadPool* pool)
+    : BarnesHutGravity(pool)
+{
+}
+
+void FmmGravity::ComputeAccelerations(ParticleView particles, AccelOut out)
+{
+    BuildTree(particles, TreeBuild::Morton);
+
+    NBODY_PROFILE_SCOPE(Phase::Force);
+
+    WalkCount count = fmm.Evaluate(tree, particles, out, pool);
+
+    NBODY_PROFILE_ADD(ProfileCounter::CellCellInteractions, count.nodes);
+    NBODY_PROFILE_ADD(ProfileCounter::BodyBodyInteractions, count.bodies);
+}
+
+const int* FmmGravity::BodyOrder() const
+{
+    return tree.order.empty() ? nullptr : tree.order.data();
+}
+
+bool FmmGravity::SetOption(const std::string& name, float value)
+{
+    if (name == "order")
+    {
+        fmm.SetOrder(static_cast<int>(value));
+    }
+    else if (name == "theta")
+    {
+        fmm.theta = value;
+    }
+    else
+    {
+        return BarnesHutGravity::SetOption(name, value);
+    }
+    return true;
+}
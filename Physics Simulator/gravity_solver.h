@@ -0,0 +1,135 @@
+#pragma once
+
+#include "bhtree.h"
+#include "fmm.h"
+#include "gravity.h"
+#include "particle_set.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// A way of computing the gravity of a set of bodies on each other, using
+// the force law in gravity.h. Backends are created by name from the
+// registry below, so the simulation, the viewer and the batch runner can
+// switch between them without knowing what they are.
+//
+// A backend may keep state between calls, such as a tree, but never keeps
+// the bodies: every call gets them again.
+class GravitySolver
+{
+public:
+    virtual ~GravitySolver();
+
+    // Stores the acceleration, and the potential when out.phi is set, on
+    // every body of particles. out has room for particles.Size() entries.
+    virtual void ComputeAccelerations(ParticleView particles, AccelOut out) = 0;
+
+    // The same for the count bodies listed in targets only, each stored at
+    // its own index in out. Meant for block timesteps, which update a few
+    // bodies between full evaluations: a backend may reuse whatever the last
+    // full evaluation of the same bodies built, with the bodies moved since.
+    virtual void ComputeAccelerations(ParticleView particles, const int* targets, int count, AccelOut out) = 0;
+
+    // body indices in an order that keeps nearby bodies together, from the
+    // last full evaluation, or null if the backend has none
+    virtual const int* BodyOrder() const;
+
+    // Changes a tuning parameter by name, e.g. "theta". Returns false if
+    // the backend has no such parameter; see the registry for the names.
+    virtual bool SetOption(const std::string& name, float value);
+};
+
+typedef std::unique_ptr<GravitySolver> (*GravitySolverFactory)(ThreadPool* pool);
+
+struct GravitySolverInfo
+{
+    std::string name;
+    // one line for --help, including the options the backend takes
+    std::string description;
+    GravitySolverFactory create;
+};
+
+// Adds a backend, or replaces the one with the same name. The built-in
+// ones, direct, bh and fmm, are always there.
+void RegisterGravitySolver(const std::string& name, const std::string& description, GravitySolverFactory create);
+
+// every registered backend, in the order they were added
+const std::vector<GravitySolverInfo>& GravitySolvers();
+
+// A new backend running on pool, which may be null for a single thread.
+// Returns null for an unknown name.
+std::unique_ptr<GravitySolver> CreateGravitySolver(const std::string& name, ThreadPool* pool);
+
+// Every body against every other with the SIMD direct kernel. Exact up to
+// rounding, and O(N^2).
+class DirectGravity : public GravitySolver
+{
+public:
+    explicit DirectGravity(ThreadPool* pool);
+
+    void ComputeAccelerations(ParticleView particles, AccelOut out) override;
+    void ComputeAccelerations(ParticleView particles, const int* targets, int count, AccelOut out) override;
+
+private:
+    ThreadPool* pool;
+    // the listed bodies and their results, gathered for the kernel
+    AlignedVector<float> gather_x, gather_y, gather_z;
+    AlignedVector<float> gather_ax, gather_ay, gather_az, gather_phi;
+};
+
+// Barnes-Hut tree walk, rebuilding the octree on every full evaluation.
+// Options: theta, leaf (tree.leaf_capacity), group (group_size) and
+// quadrupole (0 or 1).
+class BarnesHutGravity : public GravitySolver
+{
+public:
+    explicit BarnesHutGravity(ThreadPool* pool);
+
+    void ComputeAccelerations(ParticleView particles, AccelOut out) override;
+    // refits the tree from the last full evaluation and walks it
+    void ComputeAccelerations(ParticleView particles, const int* targets, int count, AccelOut out) override;
+    const int* BodyOrder() const override;
+    bool SetOption(const std::string& name, float value) override;
+
+    BHTree tree;
+    TreeBuild build;
+    // bodies that share one tree walk with a Morton build; nearby bodies
+    // get the same interaction list and are summed together. 0 walks the
+    // tree separately for every body
+    int group_size;
+
+protected:
+    // rebuilds tree around the current positions
+    void BuildTree(ParticleView particles, TreeBuild how);
+    // walks the tree for bodies[0, count), or for 0..count-1 when bodies
+    // is null, storing each body's result at its own index in out
+    void WalkTree(ParticleView particles, const int* bodies, int count, AccelOut out);
+    // walks the tree once per group of up to group_size nearby bodies
+    void WalkGroups(ParticleView particles, AccelOut out);
+
+    ThreadPool* pool;
+
+private:
+    // grouped walks: the groups' tree nodes, and buffers for each thread
+    std::vector<int> groups;
+    std::vector<GroupScratch> group_buffers;
+};
+
+// Fast multipole method on the same octree, always built from Morton keys.
+// Partial updates walk that tree like BarnesHutGravity. Options: order and
+// theta for the expansions, plus the Barnes-Hut ones for the tree.
+class FmmGravity : public BarnesHutGravity
+{
+public:
+    explicit FmmGravity(ThreadPool* pool);
+
+    void ComputeAccelerations(ParticleView particles, AccelOut out) override;
+    using BarnesHutGravity::ComputeAccelerations;
+    const int* BodyOrder() const override;
+    bool SetOption(const std::string& name, float value) override;
+
+    FmmSolver fmm;
+};
@@ -0,0 +1,439 @@
+#include "initial_conditions.h"
+
+#include "gravity.h"
+#include "gravity_solver.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+// bodies each thread fills at a time
+const int FILL_CHUNK = 4096;
+// bodies the potential energy is measured on for the virial scaling
+const size_t VIRIAL_SAMPLE = 16384;
+
+const double PI_D = 3.14159265358979323846;
+
+// Runs body(begin, end, thread) over [0, count) on pool, or on the calling
+// thread alone without one.
+template <typename Body>
+static void ForEachChunk(ThreadPool* pool, int count, int chunk, Body body)
+{
+    if (pool)
+    {
+        pool->ParallelFor(count, chunk, body);
+    }
+    else
+    {
+        body(0, count, 0);
+    }
+}
+
+// SplitMix64's output function: a bijection on 64 bits that scatters
+// neighbouring inputs across the whole range.
+static uint64_t Mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Counter-based random numbers for one body: the n-th draw is a hash of
+// (seed, body, n), with no state shared between bodies.
+class BodyRandom
+{
+public:
+    BodyRandom(uint64_t seed, uint64_t body)
+        : key(Mix(Mix(seed) ^ (body * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL)))
+        , counter(0)
+    {
+    }
+
+    // in [0, 1)
+    double Uniform()
+    {
+        ++counter;
+        return static_cast<double>(Mix(key + counter * 0x9e3779b97f4a7c15ULL) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // in (0, 1], for logarithms and powers
+    double UniformPositive()
+    {
+        return 1.0 - Uniform();
+    }
+
+    double Normal()
+    {
+        return std::sqrt(-2.0 * std::log(UniformPositive())) * std::cos(2.0 * PI_D * Uniform());
+    }
+
+    glm::dvec3 Direction()
+    {
+        double z = 2.0 * Uniform() - 1.0;
+        double phi = 2.0 * PI_D * Uniform();
+        double s = std::sqrt(1.0 - z * z);
+        return glm::dvec3(s * std::cos(phi), s * std::sin(phi), z);
+    }
+
+private:
+    uint64_t key;
+    uint64_t counter;
+};
+
+static void SetBody(ParticleSet& particles, size_t i, glm::dvec3 position, glm::dvec3 velocity, float mass)
+{
+    particles.x[i] = static_cast<float>(position.x);
+    particles.y[i] = static_cast<float>(position.y);
+    particles.z[i] = static_cast<float>(position.z);
+    particles.vx[i] = static_cast<float>(velocity.x);
+    particles.vy[i] = static_cast<float>(velocity.y);
+    particles.vz[i] = static_cast<float>(velocity.z);
+    particles.m[i] = mass;
+}
+
+// Calls fill(i, random) for bodies [begin, end) in parallel, each with its
+// own random stream.
+template <typename Fill>
+static void FillBodies(size_t begin, size_t end, uint64_t seed, ThreadPool* pool, Fill fill)
+{
+    ForEachChunk(pool, static_cast<int>(end - begin), FILL_CHUNK, [&](int first, int last, int)
+    {
+        for (int k = first; k < last; ++k)
+        {
+            size_t i = begin + k;
+            BodyRandom random(seed, i);
+            fill(i, random);
+        }
+    });
+}
+
+// Hernquist radius enclosing a random fraction of the mass, cut at 99% so
+// the rare bodies far out do not blow up the tree.
+static double HernquistRadius(BodyRandom& random, double a)
+{
+    double s = std::sqrt(0.99 * random.UniformPositive());
+    return a * s / (1.0 - s);
+}
+
+// Isotropic 1D velocity dispersion squared of a Hernquist sphere on its
+// own (Hernquist 1990, eq. 10).
+static double HernquistDispersion2(double r, double a, double mass)
+{
+    double x = r / a;
+    double bracket = 12.0 * x * std::pow(1.0 + x, 3) * std::log((1.0 + x) / x) -
+        x / (1.0 + x) * (25.0 + 52.0 * x + 42.0 * x * x + 12.0 * x * x * x);
+    return std::max(0.0, G_CONST * mass / (12.0 * a) * bracket);
+}
+
+// A Maxwellian velocity with the local Jeans dispersion, kept below escape
+// speed.
+static glm::dvec3 HernquistVelocity(BodyRandom& random, double r, double a, double mass)
+{
+    double sigma = std::sqrt(HernquistDispersion2(r, a, mass));
+    double escape2 = 2.0 * G_CONST * mass / (r + a);
+
+    for (;;)
+    {
+        glm::dvec3 v(random.Normal(), random.Normal(), random.Normal());
+        v *= sigma;
+        if (glm::dot(v, v) < 0.9 * escape2)
+        {
+            return v;
+        }
+    }
+}
+
+// Moves bodies [begin, end) to their centre of mass frame and scales their
+// velocities so that 2K + W = 0. W is summed over an even sample of the
+// bodies, each carrying the mass of the ones it stands for, which keeps
+// this cheap for millions of bodies.
+static void Virialize(ParticleSet& particles, size_t begin, size_t end, ThreadPool* pool)
+{
+    const size_t n = end - begin;
+    if (n < 2)
+    {
+        return;
+    }
+
+    // serial sums in index order, so the result does not depend on threads
+    double mass = 0.0;
+    glm::dvec3 centre(0.0), drift(0.0);
+    for (size_t i = begin; i < end; ++i)
+    {
+        double m = particles.m[i];
+        mass += m;
+        centre += m * glm::dvec3(particles.x[i], particles.y[i], particles.z[i]);
+        drift += m * glm::dvec3(particles.vx[i], particles.vy[i], particles.vz[i]);
+    }
+    centre /= mass;
+    drift /= mass;
+
+    double kinetic = 0.0;
+    for (size_t i = begin; i < end; ++i)
+    {
+        glm::dvec3 v = glm::dvec3(particles.vx[i], particles.vy[i], particles.vz[i]) - drift;
+        kinetic += 0.5 * particles.m[i] * glm::dot(v, v);
+    }
+
+    const size_t stride = (n + VIRIAL_SAMPLE - 1) / VIRIAL_SAMPLE;
+    const float weight = static_cast<float>(stride);
+
+    ParticleSet sample;
+    for (size_t i = begin; i < end; i += stride)
+    {
+        sample.Add(particles.Position(i), glm::vec3(0.0f), particles.m[i] * weight);
+    }
+
+    AlignedVector<float> ax(sample.Size()), ay(sample.Size()), az(sample.Size()), phi(sample.Size());
+    BarnesHutGravity solver(pool);
+    solver.ComputeAccelerations(sample, AccelOut{ ax.data(), ay.data(), az.data(), phi.data() });
+
+    double potential = 0.0;
+    for (size_t k = 0; k < sample.Size(); ++k)
+    {
+        potential += 0.5 * sample.m[k] * phi[k];
+    }
+
+    double scale = kinetic > 0.0 && potential < 0.0 ? std::sqrt(-potential / (2.0 * kinetic)) : 1.0;
+
+    for (size_t i = begin; i < end; ++i)
+    {
+        particles.x[i] -= static_cast<float>(centre.x);
+        particles.y[i] -= static_cast<float>(centre.y);
+        particles.z[i] -= static_cast<float>(centre.z);
+        particles.vx[i] = static_cast<float>((particles.vx[i] - drift.x) * scale);
+        particles.vy[i] = static_cast<float>((particles.vy[i] - drift.y) * scale);
+        particles.vz[i] = static_cast<float>((particles.vz[i] - drift.z) * scale);
+    }
+}
+
+static void GenerateShell(ParticleSet& particles, const InitialConditionsOptions& options, ThreadPool* pool)
+{
+    const float mass = options.total_mass / options.count;
+    const double radius = options.scale;
+
+    FillBodies(0, options.count, options.seed, pool, [&](size_t i, BodyRandom& random)
+    {
+        SetBody(particles, i, random.Direction() * radius, glm::dvec3(0.0), mass);
+    });
+}
+
+static void GenerateColdSphere(ParticleSet& particles, const InitialConditionsOptions& options, ThreadPool* pool)
+{
+    const float mass = options.total_mass / options.count;
+    const double radius = options.scale;
+
+    FillBodies(0, options.count, options.seed, pool, [&](size_t i, BodyRandom& random)
+    {
+        double r = radius * std::cbrt(random.Uniform());
+        SetBody(particles, i, random.Direction() * r, glm::dvec3(0.0), mass);
+    });
+}
+
+static void GeneratePlummer(ParticleSet& particles, const InitialConditionsOptions& options, ThreadPool* pool)
+{
+    const float mass = options.total_mass / options.count;
+    const double a = options.scale;
+    const double total = options.total_mass;
+
+    FillBodies(0, options.count, options.seed, pool, [&](size_t i, BodyRandom& random)
+    {
+        // inverse of the cumulative mass, cut at 99.9%
+        double u = 0.999 * random.UniformPositive();
+        double r = a / std::sqrt(std::pow(u, -2.0 / 3.0) - 1.0);
+
+        // speed as a fraction q of escape speed, sampled from the
+        // distribution function by rejection (Aarseth, Henon & Wielen 1974)
+        double q;
+        for (;;)
+        {
+            q = random.Uniform();
+            double g = q * q * std::pow(1.0 - q * q, 3.5);
+            if (0.1 * random.Uniform() < g)
+            {
+                break;
+            }
+        }
+
+        double escape = std::sqrt(2.0 * G_CONST * total) * std::pow(r * r + a * a, -0.25);
+        SetBody(particles, i, random.Direction() * r, random.Direction() * (q * escape), mass);
+    });
+
+    Virialize(particles, 0, options.count, pool);
+}
+
+static void GenerateHernquist(ParticleSet& particles, const InitialConditionsOptions& options, ThreadPool* pool)
+{
+    const float mass = options.total_mass / options.count;
+    const double a = options.scale;
+    const double total = options.total_mass;
+
+    FillBodies(0, options.count, options.seed, pool, [&](size_t i, BodyRandom& random)
+    {
+        double r = HernquistRadius(random, a);
+        SetBody(particles, i, random.Direction() * r, HernquistVelocity(random, r, a, total), mass);
+    });
+
+    Virialize(particles, 0, options.count, pool);
+}
+
+// Fills bodies [begin, end) with a disk galaxy of the given mass and disk
+// scale length: a fifth of the bodies in a Hernquist bulge, the rest in an
+// exponential disk with a sech^2 vertical profile, in the xy plane.
+static void FillDiskGalaxy(ParticleSet& particles, size_t begin, size_t end, double total, double scale_length,
+    uint64_t seed, ThreadPool* pool)
+{
+    const size_t n = end - begin;
+    const size_t bulge_count = n / 5;
+    const float mass = static_cast<float>(total / n);
+
+    const double bulge_mass = total * bulge_count / n;
+    const double disk_mass = total - bulge_mass;
+    const double bulge_scale = 0.2 * scale_length;
+    const double height = 0.1 * scale_length;
+    // Toomre Q the radial dispersion is set from, stable against local
+    // collapse
+    const double toomre_q = 1.5;
+
+    FillBodies(begin, end, seed, pool, [&](size_t i, BodyRandom& random)
+    {
+        if (i - begin < bulge_count)
+        {
+            double r = HernquistRadius(random, bulge_scale);
+            SetBody(particles, i, random.Direction() * r, HernquistVelocity(random, r, bulge_scale, bulge_mass), mass);
+            return;
+        }
+
+        // R / scale_length of an exponential disk is Gamma(2)-distributed,
+        // i.e. a sum of two exponentials; cut at ten scale lengths
+        double x;
+        do
+        {
+            x = -std::log(random.UniformPositive() * random.UniformPositive());
+        } while (x > 10.0);
+
+        double radius = x * scale_length;
+        double angle = 2.0 * PI_D * random.Uniform();
+        double z = height * std::atanh(std::min(0.999999, std::max(-0.999999, 2.0 * random.Uniform() - 1.0)));
+
+        // circular speed from the mass inside R taken as spherical, with
+        // the softened force law
+        double enclosed = bulge_mass * radius * radius / ((radius + bulge_scale) * (radius + bulge_scale)) +
+            disk_mass * (1.0 - (1.0 + x) * std::exp(-x));
+        double circular2 = G_CONST * enclosed * radius * radius / std::pow(radius * radius + SOFTENING2, 1.5);
+
+        double surface = disk_mass / (2.0 * PI_D * scale_length * scale_length) * std::exp(-x);
+        double sigma_z = std::sqrt(PI_D * G_CONST * surface * height);
+        // epicycle frequency of a flat rotation curve
+        double kappa = std::sqrt(2.0 * circular2) / std::max(radius, static_cast<double>(SOFTENING));
+        double sigma_r = std::min(toomre_q * 3.36 * G_CONST * surface / kappa, 0.5 * std::sqrt(circular2));
+        double sigma_phi = sigma_r / std::sqrt(2.0);
+
+        // asymmetric drift: the pressure of the dispersion carries part of
+        // the weight, so the mean rotation is below circular
+        double rotation = std::sqrt(std::max(0.0, circular2 + sigma_r * sigma_r * (0.5 - 2.0 * x)));
+
+        double v_r = sigma_r * random.Normal();
+        double v_phi = rotation + sigma_phi * random.Normal();
+        double v_z = sigma_z * random.Normal();
+
+        double c = std::cos(angle), s = std::sin(angle);
+        SetBody(particles, i, glm::dvec3(radius * c, radius * s, z),
+            glm::dvec3(v_r * c - v_phi * s, v_r * s + v_phi * c, v_z), mass);
+    });
+
+    Virialize(particles, begin, end, pool);
+}
+
+static void GenerateDisk(ParticleSet& particles, const InitialConditionsOptions& options, ThreadPool* pool)
+{
+    FillDiskGalaxy(particles, 0, options.count, options.total_mass, options.scale, options.seed, pool);
+}
+
+static void GenerateCollision(ParticleSet& particles, const InitialConditionsOptions& options, ThreadPool* pool)
+{
+    const size_t n = options.count;
+    const size_t first = n / 2;
+    const double total = options.total_mass;
+    const double first_mass = total * first / n;
+    const double second_mass = total - first_mass;
+    const double scale_length = options.scale;
+
+    FillDiskGalaxy(particles, 0, first, first_mass, scale_length, options.seed, pool);
+    FillDiskGalaxy(particles, first, n, second_mass, scale_length, options.seed, pool);
+
+    // the second disk is tilted 60 degrees about x
+    const double tilt = PI_D / 3.0;
+    const double c = std::cos(tilt), s = std::sin(tilt);
+
+    // parabolic orbit, starting twelve scale lengths apart with an impact
+    // parameter of three; each galaxy moves opposite the other about the
+    // common centre of mass
+    const glm::dvec3 separation(12.0 * scale_length, 3.0 * scale_length, 0.0);
+    const glm::dvec3 approach(-std::sqrt(2.0 * G_CONST * total / glm::length(separation)), 0.0, 0.0);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        bool second = i >= first;
+
+        glm::dvec3 p(particles.x[i], particles.y[i], particles.z[i]);
+        glm::dvec3 v(particles.vx[i], particles.vy[i], particles.vz[i]);
+
+        if (second)
+        {
+            p = glm::dvec3(p.x, c * p.y - s * p.z, s * p.y + c * p.z);
+            v = glm::dvec3(v.x, c * v.y - s * v.z, s * v.y + c * v.z);
+        }
+
+        double share = second ? first_mass / total : -second_mass / total;
+        SetBody(particles, i, p + share * separation, v + share * approach, particles.m[i]);
+    }
+}
+
+static const std::vector<InitialConditionsInfo>& Registry()
+{
+    static const std::vector<InitialConditionsInfo> registry = {
+        { "shell", "bodies at rest on a sphere of radius scale", 1000.0f, GenerateShell },
+        { "cold", "uniform sphere of radius scale at rest, collapses", 1000.0f, GenerateColdSphere },
+        { "plummer", "Plummer sphere with Plummer radius scale", 300.0f, GeneratePlummer },
+        { "hernquist", "Hernquist sphere with scale radius scale", 300.0f, GenerateHernquist },
+        { "disk", "rotating exponential disk with scale length scale, plus a bulge", 200.0f, GenerateDisk },
+        { "collision", "two disk galaxies of scale length scale on a parabolic orbit", 100.0f, GenerateCollision },
+    };
+    return registry;
+}
+
+const std::vector<InitialConditionsInfo>& InitialConditionsModels()
+{
+    return Registry();
+}
+
+bool GenerateInitialConditions(const std::string& model, ParticleSet& particles,
+    const InitialConditionsOptions& options, ThreadPool* pool)
+{
+    for (const InitialConditionsInfo& info : Registry())
+    {
+        if (info.name != model)
+        {
+            continue;
+        }
+
+        InitialConditionsOptions resolved = options;
+        resolved.count = std::max(0, options.count);
+        if (resolved.scale <= 0.0f)
+        {
+            resolved.scale = info.default_scale;
+        }
+
+        particles.Clear();
+        particles.Resize(resolved.count);
+
+        if (resolved.count > 0)
+        {
+            info.generate(particles, resolved, pool);
+        }
+        return true;
+    }
+
+    return false;
+}
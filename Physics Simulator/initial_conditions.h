@@ -0,0 +1,52 @@
+#pragma once
+
+#include "particle_set.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// Starting setups for a run, by name:
+//
+//     shell       bodies at rest on a sphere (the original viewer setup)
+//     cold        uniform sphere at rest, for a cold collapse
+//     plummer     Plummer sphere, velocities from its distribution function
+//     hernquist   Hernquist sphere, isotropic Jeans velocities
+//     disk        exponential disk in rotation around a Hernquist bulge
+//     collision   two disk galaxies on a parabolic orbit, one inclined
+//
+// Every body draws its random numbers from a stream keyed by the seed and
+// its own index, so a body does not depend on which thread made it or on
+// what the bodies before it drew: the same seed gives the same bodies for
+// any thread count. Models with motion are scaled to virial equilibrium,
+// 2K + W = 0, with the potential energy measured on a sample of bodies;
+// the collision does that for each galaxy before putting them on their
+// orbit. All models are centered on the origin at rest, with G_CONST.
+struct InitialConditionsOptions
+{
+    int count = 10000;
+    uint64_t seed = 1;
+    float total_mass = 50000.0f;
+    // size of the system, e.g. the Plummer radius or the disk scale length;
+    // 0 takes the model's default
+    float scale = 0.0f;
+};
+
+typedef void (*InitialConditionsGenerator)(ParticleSet& particles, const InitialConditionsOptions& options, ThreadPool* pool);
+
+struct InitialConditionsInfo
+{
+    std::string name;
+    std::string description;
+    float default_scale;
+    InitialConditionsGenerator generate;
+};
+
+const std::vector<InitialConditionsInfo>& InitialConditionsModels();
+
+// Replaces particles with the named model; pool may be null. Returns false
+// if there is no such model.
+bool GenerateInitialConditions(const std::string& model, ParticleSet& particles,
+    const InitialConditionsOptions& options, ThreadPool* pool = nullptr);
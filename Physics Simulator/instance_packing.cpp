@@ -0,0 +1,31 @@
+#include "instance_packing.h"
+#include "particle_set.h"
+
+#include <cmath>
+
+float SpriteSize(float mass)
+{
+    return std::sqrt(mass);
+}
+
+void PackInstances(const ParticleSet& particles, size_t begin, size_t end, float* out)
+{
+    const float* x = particles.x.data();
+    const float* y = particles.y.data();
+    const float* z = particles.z.data();
+    const float* m = particles.m.data();
+
+    for (size_t i = begin; i < end; ++i)
+    {
+        out[0] = x[i];
+        out[1] = y[i];
+        out[2] = z[i];
+        out[3] = SpriteSize(m[i]);
+        out += INSTANCE_STRIDE;
+    }
+}
+
+void PackInstances(const ParticleSet& particles, float* out)
+{
+    PackInstances(particles, 0, particles.Size(), out);
+}
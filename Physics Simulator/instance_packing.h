@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+class ParticleSet;
+
+// Floats per body in the sprite instance buffer: x, y, z and the sprite's
+// side length. Matches the per-instance attribute in shaders/instanced.vs.
+const int INSTANCE_STRIDE = 4;
+
+// Side of the square sprite drawn for a body of the given mass.
+float SpriteSize(float mass);
+
+// Writes bodies [begin, end) as instances starting at out, which must have
+// room for INSTANCE_STRIDE * (end - begin) floats. Writes are strictly
+// sequential so out may point straight into a mapped GL buffer.
+void PackInstances(const ParticleSet& particles, size_t begin, size_t end, float* out);
+void PackInstances(const ParticleSet& particles, float* out);
@@ -0,0 +1,155 @@
+/*******************************************************************
+** This code is part of Breakout.
+**
+** Breakout is free software: you can redistribute it and/or modify
+** it under the terms of the CC BY 4.0 license as published by
+** Creative Commons, either version 4 of the License, or (at your
+** option) any later version.
+******************************************************************/
+#include "instance_renderer.h"
+#include "instance_packing.h"
+
+#include <cstring>
+
+const GLuint64 FENCE_TIMEOUT = 1000000000; // nanoseconds
+
+
+InstanceRenderer::InstanceRenderer(Shader& shader, unsigned int capacity)
+    : quadVAO(0), quadVBO(0), instanceVBO(0), capacity(0), section(0)
+{
+    this->shader = shader;
+    for (int i = 0; i < INSTANCE_SECTIONS; ++i)
+    {
+        this->fences[i] = nullptr;
+    }
+    this->initRenderData();
+    this->reserve(capacity);
+}
+
+InstanceRenderer::~InstanceRenderer()
+{
+    for (int i = 0; i < INSTANCE_SECTIONS; ++i)
+    {
+        if (this->fences[i])
+        {
+            glDeleteSync(this->fences[i]);
+        }
+    }
+    glDeleteBuffers(1, &this->instanceVBO);
+    glDeleteBuffers(1, &this->quadVBO);
+    glDeleteVertexArrays(1, &this->quadVAO);
+}
+
+void InstanceRenderer::DrawInstances(Texture2D& texture, const float* instances, unsigned int count, glm::vec3 color)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    this->reserve(count);
+
+    // take the next section and make sure the GPU has finished drawing from it
+    this->section = (this->section + 1) % INSTANCE_SECTIONS;
+    this->waitSection(this->section);
+
+    GLintptr offset = static_cast<GLintptr>(this->section) * this->capacity * INSTANCE_STRIDE * sizeof(float);
+    GLsizeiptr bytes = static_cast<GLsizeiptr>(count) * INSTANCE_STRIDE * sizeof(float);
+
+    // the fence already guarantees the range is free, so skip the driver's own sync
+    glBindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+    void* mapped = glMapBufferRange(GL_ARRAY_BUFFER, offset, bytes,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (!mapped)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return;
+    }
+    std::memcpy(mapped, instances, bytes);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+
+    this->shader.Use();
+    this->shader.SetVector3f("spriteColor", color);
+
+    glActiveTexture(GL_TEXTURE0);
+    texture.Bind();
+
+    glBindVertexArray(this->quadVAO);
+    glVertexAttribPointer(1, INSTANCE_STRIDE, GL_FLOAT, GL_FALSE, INSTANCE_STRIDE * sizeof(float), (void*)offset);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, count);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    this->fences[this->section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void InstanceRenderer::initRenderData()
+{
+    // unit quad centered on the origin; the vertex shader scales and moves it
+    float vertices[] = {
+        // pos        // tex
+        -0.5f,  0.5f, 0.0f, 1.0f,
+         0.5f, -0.5f, 1.0f, 0.0f,
+        -0.5f, -0.5f, 0.0f, 0.0f,
+
+        -0.5f,  0.5f, 0.0f, 1.0f,
+         0.5f,  0.5f, 1.0f, 1.0f,
+         0.5f, -0.5f, 1.0f, 0.0f
+    };
+
+    glGenVertexArrays(1, &this->quadVAO);
+    glGenBuffers(1, &this->quadVBO);
+    glGenBuffers(1, &this->instanceVBO);
+
+    glBindBuffer(GL_ARRAY_BUFFER, this->quadVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+    glBindVertexArray(this->quadVAO);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+
+    // one <vec3 position, float size> per instance, pointed at a section per draw
+    glBindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+    glEnableVertexAttribArray(1);
+    glVertexAttribDivisor(1, 1);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+void InstanceRenderer::reserve(unsigned int count)
+{
+    if (count <= this->capacity)
+    {
+        return;
+    }
+
+    // the old storage may still be in use, but orphaning it is safe
+    for (int i = 0; i < INSTANCE_SECTIONS; ++i)
+    {
+        if (this->fences[i])
+        {
+            glDeleteSync(this->fences[i]);
+            this->fences[i] = nullptr;
+        }
+    }
+
+    // grow geometrically so a slowly growing body count does not realloc every frame
+    unsigned int grown = this->capacity + this->capacity / 2;
+    this->capacity = count > grown ? count : grown;
+
+    GLsizeiptr bytes = static_cast<GLsizeiptr>(this->capacity) * INSTANCE_SECTIONS * INSTANCE_STRIDE * sizeof(float);
+    glBindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstanceRenderer::waitSection(int s)
+{
+    if (!this->fences[s])
+    {
+        return;
+    }
+    glClientWaitSync(this->fences[s], GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT);
+    glDeleteSync(this->fences[s]);
+    this->fences[s] = nullptr;
+}
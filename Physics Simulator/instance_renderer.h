@@ -0,0 +1,51 @@
+/*******************************************************************
+** This code is part of Breakout.
+**
+** Breakout is free software: you can redistribute it and/or modify
+** it under the terms of the CC BY 4.0 license as published by
+** Creative Commons, either version 4 of the License, or (at your
+** option) any later version.
+******************************************************************/
+#ifndef INSTANCE_RENDERER_H
+#define INSTANCE_RENDERER_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "texture.h"
+#include "shader.h"
+
+// Draws every body as a textured square with one instanced draw call.
+// Per-body data (position and size, see instance_packing.h) is streamed
+// into one buffer split into INSTANCE_SECTIONS parts used in turn; a fence
+// per part keeps the CPU from overwriting data the GPU is still reading,
+// so mapping never has to wait on a buffer in flight.
+class InstanceRenderer
+{
+public:
+    // Constructor (inits shaders/shapes); capacity grows on demand
+    InstanceRenderer(Shader& shader, unsigned int capacity = 0);
+    // Destructor
+    ~InstanceRenderer();
+    // Copies count packed instances into the next buffer section and draws them all
+    void DrawInstances(Texture2D& texture, const float* instances, unsigned int count, glm::vec3 color = glm::vec3(1.0f));
+private:
+    static const int INSTANCE_SECTIONS = 3;
+
+    // Render state
+    Shader       shader;
+    unsigned int quadVAO;
+    unsigned int quadVBO;
+    unsigned int instanceVBO;
+    unsigned int capacity;
+    int          section;
+    GLsync       fences[INSTANCE_SECTIONS];
+    // Initializes and configures the quad's buffer and vertex attributes
+    void initRenderData();
+    // Reallocates the instance buffer to hold at least count instances
+    void reserve(unsigned int count);
+    // Waits until the GPU is done with the given section
+    void waitSection(int s);
+};
+
+#endif
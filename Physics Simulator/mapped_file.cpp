@@ -0,0 +1,160 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+    : data(nullptr)
+    , size(0)
+#ifdef _WIN32
+    , file(INVALID_HANDLE_VALUE)
+    , mapping(nullptr)
+#else
+    , file(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::string& path)
+{
+    Close();
+
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER length;
+    if (!GetFileSizeEx(file, &length))
+    {
+        Close();
+        return false;
+    }
+
+    size = static_cast<size_t>(length.QuadPart);
+    if (size == 0)
+    {
+        return true;
+    }
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+    {
+        Close();
+        return false;
+    }
+
+    data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!data)
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data)
+    {
+        UnmapViewOfFile(data);
+    }
+    if (mapping)
+    {
+        CloseHandle(mapping);
+    }
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+
+    data = nullptr;
+    size = 0;
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedFile::Open(const std::string& path)
+{
+    Close();
+
+    file = open(path.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(file, &status) != 0)
+    {
+        Close();
+        return false;
+    }
+
+    size = static_cast<size_t>(status.st_size);
+    if (size == 0)
+    {
+        return true;
+    }
+
+    void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (address == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+
+    // callers read the whole file, so start reading it in now
+    madvise(address, size, MADV_WILLNEED);
+
+    data = static_cast<const unsigned char*>(address);
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data)
+    {
+        munmap(const_cast<unsigned char*>(data), size);
+    }
+    if (file >= 0)
+    {
+        close(file);
+    }
+
+    data = nullptr;
+    size = 0;
+    file = -1;
+}
+
+#endif
+
+const unsigned char* MappedFile::Data() const
+{
+    return data;
+}
+
+size_t MappedFile::Size() const
+{
+    return size;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// A whole file mapped read-only into memory, so a large file can be used
+// in place without reading it through a buffer first. Pages are loaded by
+// the OS as they are touched. The mapping lasts as long as the object.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // maps path, unmapping any earlier file first; false if it cannot be
+    // opened or mapped. An empty file maps to no data
+    bool Open(const std::string& path);
+    void Close();
+
+    const unsigned char* Data() const;
+    size_t Size() const;
+
+private:
+    const unsigned char* data;
+    size_t size;
+
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#else
+    int file;
+#endif
+};
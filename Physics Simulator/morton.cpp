@@ -0,0 +1,128 @@
+#include "morton.h"
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <functional>
+
+// smaller inputs are sorted on the calling thread
+const size_t RADIX_PARALLEL_MIN = 1 << 16;
+
+// spreads the low 21 bits of v so that there are two zero bits between each
+static uint64_t SpreadBits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+static uint64_t Quantize(float coord, float min_coord, float length)
+{
+    const float cells = static_cast<float>(1 << MORTON_BITS);
+
+    float cell = (coord - min_coord) / length * cells;
+    cell = std::min(std::max(cell, 0.0f), cells - 1.0f);
+
+    return static_cast<uint64_t>(cell);
+}
+
+uint64_t MortonKey(glm::vec3 position, glm::vec3 min_corner, float length)
+{
+    uint64_t x = Quantize(position.x, min_corner.x, length);
+    uint64_t y = Quantize(position.y, min_corner.y, length);
+    uint64_t z = Quantize(position.z, min_corner.z, length);
+
+    return (SpreadBits(x) << 0) | (SpreadBits(y) << 1) | (SpreadBits(z) << 2);
+}
+
+void RadixSort(std::vector<uint64_t>& keys, std::vector<int>& index,
+    std::vector<uint64_t>& key_scratch, std::vector<int>& index_scratch,
+    std::vector<size_t>& count_scratch, ThreadPool* pool)
+{
+    const size_t n = keys.size();
+    const int blocks = pool && n >= RADIX_PARALLEL_MIN ? pool->ThreadCount() : 1;
+
+    key_scratch.resize(n);
+    index_scratch.resize(n);
+
+    // one digit histogram per block; scattering blocks in order keeps the sort stable
+    std::vector<size_t>& count = count_scratch;
+    count.resize(static_cast<size_t>(blocks) * 256);
+
+    auto block_begin = [&](int b) { return n * b / blocks; };
+
+    auto for_each_block = [&](const std::function<void(int)>& fn)
+    {
+        if (blocks == 1)
+        {
+            fn(0);
+            return;
+        }
+        pool->ParallelFor(blocks, 1, [&](int begin, int end, int)
+        {
+            for (int b = begin; b < end; ++b)
+            {
+                fn(b);
+            }
+        });
+    };
+
+    // 8 passes of 8 bits cover all 63 key bits
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        std::fill(count.begin(), count.end(), 0);
+
+        for_each_block([&](int b)
+        {
+            size_t* c = &count[b * 256];
+            for (size_t i = block_begin(b); i < block_begin(b + 1); ++i)
+            {
+                c[(keys[i] >> shift) & 0xff]++;
+            }
+        });
+
+        // every key has the same digit, so this pass would not move anything
+        if (n > 0)
+        {
+            size_t same = 0;
+            size_t digit = (keys[0] >> shift) & 0xff;
+            for (int b = 0; b < blocks; ++b)
+            {
+                same += count[b * 256 + digit];
+            }
+            if (same == n)
+            {
+                continue;
+            }
+        }
+
+        size_t offset = 0;
+        for (int d = 0; d < 256; ++d)
+        {
+            for (int b = 0; b < blocks; ++b)
+            {
+                size_t c = count[b * 256 + d];
+                count[b * 256 + d] = offset;
+                offset += c;
+            }
+        }
+
+        for_each_block([&](int b)
+        {
+            size_t* c = &count[b * 256];
+            for (size_t i = block_begin(b); i < block_begin(b + 1); ++i)
+            {
+                size_t dst = c[(keys[i] >> shift) & 0xff]++;
+                key_scratch[dst] = keys[i];
+                index_scratch[dst] = index[i];
+            }
+        });
+
+        keys.swap(key_scratch);
+        index.swap(index_scratch);
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// Morton (Z-order) keys interleave 21 bits per axis into a 63-bit integer,
+// so sorting by key orders points along a space-filling curve. Each group of
+// three bits, starting from the top, is the octant index at one tree level,
+// using the same x = 1, y = 2, z = 4 layout as Oct::GetSubtree.
+const int MORTON_BITS = 21;
+
+uint64_t MortonKey(glm::vec3 position, glm::vec3 min_corner, float length);
+
+// Returns the octant index of a key at the given depth (0 is the root).
+inline int MortonOctant(uint64_t key, int depth)
+{
+    return static_cast<int>((key >> (3 * (MORTON_BITS - 1 - depth))) & 7);
+}
+
+// LSD radix sort of keys, carrying the body index array along with them.
+// The scratch vectors, digit histograms included, are only resized, so
+// repeated calls do not allocate. With a pool, each pass counts and
+// scatters one block per thread.
+void RadixSort(std::vector<uint64_t>& keys, std::vector<int>& index,
+    std::vector<uint64_t>& key_scratch, std::vector<int>& index_scratch,
+    std::vector<size_t>& count_scratch, ThreadPool* pool = nullptr);
@@ -0,0 +1,160 @@
+#include "particle_set.h"
+
+#include <algorithm>
+
+ParticleSet::ParticleSet()
+    : count(0)
+{
+}
+
+size_t ParticleSet::Size() const
+{
+    return count;
+}
+
+size_t ParticleSet::PaddedSize() const
+{
+    return m.size();
+}
+
+void ParticleSet::Add(glm::vec3 position, glm::vec3 velocity, float mass)
+{
+    if (count == m.size())
+    {
+        size_t padded = m.size() + PARTICLE_PADDING;
+
+        for (AlignedVector<float>* column : { &x, &y, &z, &vx, &vy, &vz, &m, &ax, &ay, &az })
+        {
+            column->resize(padded, 0.0f);
+        }
+    }
+
+    x[count] = position.x;
+    y[count] = position.y;
+    z[count] = position.z;
+    vx[count] = velocity.x;
+    vy[count] = velocity.y;
+    vz[count] = velocity.z;
+    m[count] = mass;
+    ax[count] = 0.0f;
+    ay[count] = 0.0f;
+    az[count] = 0.0f;
+    id.push_back(static_cast<uint32_t>(count));
+
+    ++count;
+}
+
+void ParticleSet::Clear()
+{
+    for (AlignedVector<float>* column : { &x, &y, &z, &vx, &vy, &vz, &m, &ax, &ay, &az })
+    {
+        column->clear();
+    }
+    id.clear();
+    count = 0;
+}
+
+void ParticleSet::Resize(size_t size)
+{
+    size_t padded = (size + PARTICLE_PADDING - 1) / PARTICLE_PADDING * PARTICLE_PADDING;
+
+    for (AlignedVector<float>* column : { &x, &y, &z, &vx, &vy, &vz, &m, &ax, &ay, &az })
+    {
+        column->resize(padded, 0.0f);
+
+        // shrinking leaves old bodies in what is now padding
+        std::fill(column->begin() + std::min(size, count), column->end(), 0.0f);
+    }
+
+    for (size_t i = id.size(); i < size; ++i)
+    {
+        id.push_back(static_cast<uint32_t>(i));
+    }
+    id.resize(size);
+
+    count = size;
+}
+
+glm::vec3 ParticleSet::Position(size_t i) const
+{
+    return glm::vec3(x[i], y[i], z[i]);
+}
+
+glm::vec3 ParticleSet::Velocity(size_t i) const
+{
+    return glm::vec3(vx[i], vy[i], vz[i]);
+}
+
+AccelOut ParticleSet::Acceleration()
+{
+    return AccelOut{ ax.data(), ay.data(), az.data(), nullptr };
+}
+
+void ParticleSet::Drift(float dt)
+{
+    float* px = x.data();
+    float* py = y.data();
+    float* pz = z.data();
+    const float* pvx = vx.data();
+    const float* pvy = vy.data();
+    const float* pvz = vz.data();
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        px[i] += pvx[i] * dt;
+        py[i] += pvy[i] * dt;
+        pz[i] += pvz[i] * dt;
+    }
+}
+
+void ParticleSet::Kick(float dt)
+{
+    float* pvx = vx.data();
+    float* pvy = vy.data();
+    float* pvz = vz.data();
+    const float* pax = ax.data();
+    const float* pay = ay.data();
+    const float* paz = az.data();
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        pvx[i] += pax[i] * dt;
+        pvy[i] += pay[i] * dt;
+        pvz[i] += paz[i] * dt;
+    }
+}
+
+ParticleView::ParticleView(const ParticleSet& particles)
+    : x(particles.x.data())
+    , y(particles.y.data())
+    , z(particles.z.data())
+    , m(particles.m.data())
+    , count(particles.Size())
+    , padded(particles.PaddedSize())
+{
+}
+
+ParticleView::ParticleView(const float* x, const float* y, const float* z, const float* m, size_t count, size_t padded)
+    : x(x)
+    , y(y)
+    , z(z)
+    , m(m)
+    , count(count)
+    , padded(padded)
+{
+}
+
+size_t ParticleView::Size() const
+{
+    return count;
+}
+
+size_t ParticleView::PaddedSize() const
+{
+    return padded;
+}
+
+glm::vec3 ParticleView::Position(size_t i) const
+{
+    return glm::vec3(x[i], y[i], z[i]);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "gravity.h"
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+// Alignment of every particle array, enough for a full 512-bit vector load.
+const size_t PARTICLE_ALIGNMENT = 64;
+// Arrays are padded to a multiple of this many floats (one 512-bit vector).
+const size_t PARTICLE_PADDING = 16;
+
+template <typename T, size_t Alignment = PARTICLE_ALIGNMENT>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n)
+    {
+        size_t bytes = (n * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+#ifdef _MSC_VER
+        void* p = _aligned_malloc(bytes, Alignment);
+#else
+        void* p = std::aligned_alloc(Alignment, bytes);
+#endif
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t)
+    {
+#ifdef _MSC_VER
+        _aligned_free(p);
+#else
+        std::free(p);
+#endif
+    }
+};
+
+template <typename T, typename U, size_t A>
+bool operator==(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return true; }
+template <typename T, typename U, size_t A>
+bool operator!=(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return false; }
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// Physics-side storage for all bodies, one contiguous array per component.
+// Every array holds PaddedSize() entries; the entries past Size() are
+// zero-mass particles at the origin, so vector loops can run over whole
+// registers without a scalar tail and without affecting the result.
+class ParticleSet
+{
+public:
+    AlignedVector<float> x, y, z;
+    AlignedVector<float> vx, vy, vz;
+    AlignedVector<float> m;
+    // acceleration from the last force evaluation
+    AlignedVector<float> ax, ay, az;
+    // a number that stays with a body for the whole run, for following it
+    // across output files; Add numbers bodies in the order they come.
+    // Size() entries, with no padding
+    std::vector<uint32_t> id;
+
+    ParticleSet();
+
+    size_t Size() const;
+    size_t PaddedSize() const;
+
+    void Add(glm::vec3 position, glm::vec3 velocity, float mass);
+    void Clear();
+    // Sets the number of bodies, for filling the columns directly rather
+    // than through Add, e.g. from a file. Bodies past the old size start
+    // out zero, numbered by their index.
+    void Resize(size_t size);
+
+    glm::vec3 Position(size_t i) const;
+    glm::vec3 Velocity(size_t i) const;
+
+    // the ax/ay/az columns as a force output, without a potential
+    AccelOut Acceleration();
+
+    // moves every particle along its velocity
+    void Drift(float dt);
+    // changes every velocity by the stored acceleration
+    void Kick(float dt);
+
+private:
+    size_t count;
+};
+
+// Read-only view of the positions and masses of a set of bodies, which is
+// all a force calculation reads. The arrays follow the ParticleSet layout,
+// with padding up to PaddedSize() that has zero mass. Converts from a
+// ParticleSet, so anything that takes a view also takes the set itself.
+struct ParticleView
+{
+    const float* x;
+    const float* y;
+    const float* z;
+    const float* m;
+    size_t count;
+    size_t padded;
+
+    ParticleView(const ParticleSet& particles);
+    ParticleView(const float* x, const float* y, const float* z, const float* m, size_t count, size_t padded);
+
+    size_t Size() const;
+    size_t PaddedSize() const;
+    glm::vec3 Position(size_t i) const;
+};
@@ -0,0 +1,222 @@
+#include "physics_thread.h"
+#include "checkpoint.h"
+#include "instance_packing.h"
+
+#include <iostream>
+
+// if the physics falls this far behind the wall clock it stops trying to
+// catch up, so a slow stretch does not turn into a burst of steps later
+const std::chrono::milliseconds MAX_LAG(250);
+
+ParticleSnapshot::ParticleSnapshot()
+    : count(0)
+    , step(0)
+    , time(0.0)
+{
+}
+
+glm::vec3 ParticleSnapshot::Position(size_t i) const
+{
+    const float* p = &instances[i * INSTANCE_STRIDE];
+    return glm::vec3(p[0], p[1], p[2]);
+}
+
+SnapshotBuffer::SnapshotBuffer()
+    : write_index(0)
+    , read_index(1)
+    , middle(2)
+{
+}
+
+ParticleSnapshot& SnapshotBuffer::WriteSlot()
+{
+    return slots[write_index];
+}
+
+void SnapshotBuffer::Publish()
+{
+    // release makes the slot's contents visible to the reader that takes it
+    int previous = middle.exchange(write_index | FRESH, std::memory_order_acq_rel);
+    write_index = previous & INDEX_MASK;
+}
+
+const ParticleSnapshot& SnapshotBuffer::Read()
+{
+    if (middle.load(std::memory_order_relaxed) & FRESH)
+    {
+        int previous = middle.exchange(read_index, std::memory_order_acq_rel);
+        read_index = previous & INDEX_MASK;
+    }
+    return slots[read_index];
+}
+
+PhysicsThread::PhysicsThread(Simulation& sim, float dt, float speed)
+    : sim(sim)
+    , dt(dt)
+    , speed(speed)
+    , steps(0)
+    , checkpoint_every(0)
+    , paused(false)
+    , stopping(false)
+{
+}
+
+PhysicsThread::~PhysicsThread()
+{
+    Stop();
+}
+
+void PhysicsThread::SetCheckpoint(const std::string& path, long long every)
+{
+    checkpoint_every = every;
+
+    // one buffer is plenty: checkpoints are far enough apart that the
+    // previous one is on disk long before the next is due
+    checkpoint_writer.reset(new SnapshotWriter([path](const ParticleSet& particles, const float*, long long step, double time, unsigned int)
+    {
+        std::string error;
+        if (!WriteCheckpoint(path, particles, CheckpointInfo{ static_cast<uint64_t>(step), time }, error))
+        {
+            std::cerr << error << std::endl;
+            return false;
+        }
+        return true;
+    }, 1));
+}
+
+void PhysicsThread::SetStepCount(long long step)
+{
+    steps.store(step, std::memory_order_relaxed);
+}
+
+void PhysicsThread::Start()
+{
+    if (thread.joinable())
+    {
+        return;
+    }
+
+    PublishSnapshot();
+
+    stopping = false;
+    thread = std::thread(&PhysicsThread::Run, this);
+}
+
+void PhysicsThread::Stop()
+{
+    if (!thread.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
+
+    SaveCheckpoint();
+    if (checkpoint_writer)
+    {
+        checkpoint_writer->Flush();
+    }
+}
+
+void PhysicsThread::SetPaused(bool paused)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (this->paused == paused)
+        {
+            return;
+        }
+        this->paused = paused;
+    }
+    wake.notify_all();
+}
+
+const ParticleSnapshot& PhysicsThread::Latest()
+{
+    return snapshots.Read();
+}
+
+float PhysicsThread::TimeStep() const
+{
+    return dt;
+}
+
+long long PhysicsThread::StepsTaken() const
+{
+    return steps.load(std::memory_order_relaxed);
+}
+
+void PhysicsThread::Run()
+{
+    typedef std::chrono::steady_clock Clock;
+    const Clock::duration step_length = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(dt / speed));
+
+    Clock::time_point next = Clock::now();
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (paused)
+            {
+                wake.wait(lock, [this] { return stopping || !paused; });
+                next = Clock::now();
+            }
+            // one step per dt / speed of wall time
+            wake.wait_until(lock, next, [this] { return stopping || paused; });
+            if (stopping)
+            {
+                return;
+            }
+            if (paused)
+            {
+                continue;
+            }
+        }
+
+        sim.Step(dt);
+        long long taken = steps.fetch_add(1, std::memory_order_relaxed) + 1;
+        PublishSnapshot();
+
+        if (checkpoint_every > 0 && taken % checkpoint_every == 0)
+        {
+            SaveCheckpoint();
+        }
+
+        next += step_length;
+        Clock::time_point now = Clock::now();
+        if (now - next > MAX_LAG)
+        {
+            next = now;
+        }
+    }
+}
+
+void PhysicsThread::PublishSnapshot()
+{
+    ParticleSnapshot& snapshot = snapshots.WriteSlot();
+
+    snapshot.count = sim.Particles.Size();
+    snapshot.instances.resize(snapshot.count * INSTANCE_STRIDE);
+    PackInstances(sim.Particles, snapshot.instances.data());
+    snapshot.step = steps.load(std::memory_order_relaxed);
+    snapshot.time = snapshot.step * static_cast<double>(dt);
+
+    snapshots.Publish();
+}
+
+void PhysicsThread::SaveCheckpoint()
+{
+    if (!checkpoint_writer)
+    {
+        return;
+    }
+
+    long long step = steps.load(std::memory_order_relaxed);
+    checkpoint_writer->Submit(sim.Particles, step, step * static_cast<double>(dt));
+}
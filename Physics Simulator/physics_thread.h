@@ -0,0 +1,111 @@
+#pragma once
+
+#include "simulation.h"
+#include "snapshot_writer.h"
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// What the renderer needs from one simulation step: every body packed as an
+// instance (see instance_packing.h) plus when the step was taken.
+struct ParticleSnapshot
+{
+    std::vector<float> instances;
+    size_t count;
+    long long step;
+    double time;
+
+    ParticleSnapshot();
+    glm::vec3 Position(size_t i) const;
+};
+
+// Triple buffer with one writer and one reader that never block each other.
+// The writer fills WriteSlot() and publishes it; the reader always gets the
+// newest published snapshot and keeps it until its next Read(). The third
+// slot sits in between, so neither side ever touches a slot the other owns.
+class SnapshotBuffer
+{
+public:
+    SnapshotBuffer();
+
+    // writer side
+    ParticleSnapshot& WriteSlot();
+    void Publish();
+
+    // reader side; the reference stays valid until the next call
+    const ParticleSnapshot& Read();
+
+private:
+    static const int FRESH = 4;
+    static const int INDEX_MASK = 3;
+
+    ParticleSnapshot slots[3];
+    int write_index;
+    int read_index;
+    // index of the slot in between, with FRESH set when the writer has put
+    // a snapshot there that the reader has not picked up yet
+    std::atomic<int> middle;
+};
+
+// Runs a Simulation on its own thread with a fixed timestep, paced to the
+// wall clock, and publishes a snapshot after every step. The render loop
+// reads snapshots without locking, so a slow step never holds up a frame
+// and a frame waiting on vsync never holds up the physics.
+class PhysicsThread
+{
+public:
+    // sim must outlive the thread and must not be touched while it runs;
+    // it steps with whatever solver sim has. speed is simulated time per
+    // second of wall time
+    PhysicsThread(Simulation& sim, float dt, float speed = 1.0f);
+    ~PhysicsThread();
+
+    // Saves the state to path every `every` steps, and once more when the
+    // thread stops; 0 only saves on stop. The physics thread only copies
+    // the bodies between steps; the file is written on a writer thread of
+    // its own. Call before Start.
+    void SetCheckpoint(const std::string& path, long long every);
+    // carries on counting steps from a restored checkpoint; call before Start
+    void SetStepCount(long long step);
+
+    // publishes the initial state, then starts stepping
+    void Start();
+    void Stop();
+
+    void SetPaused(bool paused);
+
+    // newest snapshot; call from one thread only (the render loop)
+    const ParticleSnapshot& Latest();
+
+    float TimeStep() const;
+    long long StepsTaken() const;
+
+private:
+    void Run();
+    void PublishSnapshot();
+    void SaveCheckpoint();
+
+    Simulation& sim;
+    float dt;
+    float speed;
+
+    SnapshotBuffer snapshots;
+    std::atomic<long long> steps;
+
+    long long checkpoint_every;
+    std::unique_ptr<SnapshotWriter> checkpoint_writer;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool paused;
+    bool stopping;
+};
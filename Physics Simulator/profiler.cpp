@@ -0,0 +1,225 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <fstream>
+
+std::vector<StepProfile> Profiler::steps;
+size_t Profiler::capacity = PROFILE_HISTORY;
+size_t Profiler::oldest = 0;
+long long Profiler::dropped = 0;
+double Profiler::current_seconds[PHASE_COUNT];
+std::atomic<long long> Profiler::current_counters[PROFILE_COUNTER_COUNT];
+
+void Profiler::BeginStep()
+{
+    for (int i = 0; i < PHASE_COUNT; ++i)
+    {
+        current_seconds[i] = 0.0;
+    }
+    for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+    {
+        current_counters[i] = 0;
+    }
+}
+
+void Profiler::EndStep()
+{
+    StepProfile step;
+
+    for (int i = 0; i < PHASE_COUNT; ++i)
+    {
+        step.seconds[i] = current_seconds[i];
+    }
+    for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+    {
+        step.counters[i] = current_counters[i];
+    }
+
+    if (capacity == 0 || steps.size() < capacity)
+    {
+        steps.push_back(step);
+        return;
+    }
+
+    steps[oldest] = step;
+    oldest = (oldest + 1) % steps.size();
+    ++dropped;
+}
+
+void Profiler::AddTime(Phase phase, double seconds)
+{
+    current_seconds[static_cast<int>(phase)] += seconds;
+}
+
+void Profiler::Add(ProfileCounter counter, long long amount)
+{
+    current_counters[static_cast<int>(counter)].fetch_add(amount, std::memory_order_relaxed);
+}
+
+void Profiler::Set(ProfileCounter counter, long long value)
+{
+    current_counters[static_cast<int>(counter)] = value;
+}
+
+void Profiler::SetCapacity(size_t new_capacity)
+{
+    // unroll the ring so the oldest step is first again
+    std::rotate(steps.begin(), steps.begin() + oldest, steps.end());
+    oldest = 0;
+
+    if (new_capacity > 0 && steps.size() > new_capacity)
+    {
+        size_t excess = steps.size() - new_capacity;
+        steps.erase(steps.begin(), steps.begin() + excess);
+        dropped += static_cast<long long>(excess);
+    }
+
+    capacity = new_capacity;
+}
+
+size_t Profiler::Capacity()
+{
+    return capacity;
+}
+
+size_t Profiler::StepCount()
+{
+    return steps.size();
+}
+
+const StepProfile& Profiler::Step(size_t i)
+{
+    return steps[(oldest + i) % steps.size()];
+}
+
+long long Profiler::FirstStep()
+{
+    return dropped;
+}
+
+void Profiler::Clear()
+{
+    steps.clear();
+    oldest = 0;
+    dropped = 0;
+}
+
+const char* Profiler::Name(Phase phase)
+{
+    switch (phase)
+    {
+    case Phase::Bounds:
+        return "bounds";
+    case Phase::TreeBuild:
+        return "tree_build";
+    case Phase::Force:
+        return "force";
+    case Phase::Kick:
+        return "kick";
+    case Phase::Drift:
+        return "drift";
+    default:
+        return "unknown";
+    }
+}
+
+const char* Profiler::Name(ProfileCounter counter)
+{
+    switch (counter)
+    {
+    case ProfileCounter::NodesAllocated:
+        return "nodes_allocated";
+    case ProfileCounter::TreeDepth:
+        return "tree_depth";
+    case ProfileCounter::BodyNodeInteractions:
+        return "body_node_interactions";
+    case ProfileCounter::BodyBodyInteractions:
+        return "body_body_interactions";
+    case ProfileCounter::CellCellInteractions:
+        return "cell_cell_interactions";
+    case ProfileCounter::ForceEvaluations:
+        return "force_evaluations";
+    case ProfileCounter::ForceUpdates:
+        return "force_updates";
+    default:
+        return "unknown";
+    }
+}
+
+bool Profiler::WriteCsv(const std::string& path)
+{
+    std::ofstream file(path);
+    if (!file)
+    {
+        return false;
+    }
+
+    file << "step";
+    for (int i = 0; i < PHASE_COUNT; ++i)
+    {
+        file << "," << Name(static_cast<Phase>(i)) << "_ms";
+    }
+    for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+    {
+        file << "," << Name(static_cast<ProfileCounter>(i));
+    }
+    file << "\n";
+
+    for (size_t s = 0; s < steps.size(); ++s)
+    {
+        const StepProfile& step = Step(s);
+
+        file << dropped + static_cast<long long>(s);
+        for (int i = 0; i < PHASE_COUNT; ++i)
+        {
+            file << "," << step.seconds[i] * 1000.0;
+        }
+        for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+        {
+            file << "," << step.counters[i];
+        }
+        file << "\n";
+    }
+
+    return static_cast<bool>(file);
+}
+
+bool Profiler::WriteJson(const std::string& path)
+{
+    std::ofstream file(path);
+    if (!file)
+    {
+        return false;
+    }
+
+    file << "[\n";
+    for (size_t s = 0; s < steps.size(); ++s)
+    {
+        const StepProfile& step = Step(s);
+
+        file << "  {\"step\": " << dropped + static_cast<long long>(s);
+        for (int i = 0; i < PHASE_COUNT; ++i)
+        {
+            file << ", \"" << Name(static_cast<Phase>(i)) << "_ms\": " << step.seconds[i] * 1000.0;
+        }
+        for (int i = 0; i < PROFILE_COUNTER_COUNT; ++i)
+        {
+            file << ", \"" << Name(static_cast<ProfileCounter>(i)) << "\": " << step.counters[i];
+        }
+        file << (s + 1 < steps.size() ? "},\n" : "}\n");
+    }
+    file << "]\n";
+
+    return static_cast<bool>(file);
+}
+
+ScopedTimer::ScopedTimer(Phase phase)
+    : phase(phase)
+    , start(std::chrono::steady_clock::now())
+{
+}
+
+ScopedTimer::~ScopedTimer()
+{
+    Profiler::AddTime(phase, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Optional per-step instrumentation. Build with NBODY_PROFILE defined to
+// record phase timings and counters; without it every NBODY_PROFILE_*
+// macro compiles to nothing.
+
+// Parts of a simulation step that get their own timer.
+enum class Phase
+{
+    Bounds,
+    TreeBuild,
+    Force,
+    Kick,
+    Drift,
+    Count
+};
+
+// Per-step counters recorded next to the timings.
+enum class ProfileCounter
+{
+    NodesAllocated,
+    TreeDepth,
+    BodyNodeInteractions,
+    BodyBodyInteractions,
+    CellCellInteractions,
+    ForceEvaluations,
+    ForceUpdates,
+    Count
+};
+
+const int PHASE_COUNT = static_cast<int>(Phase::Count);
+const int PROFILE_COUNTER_COUNT = static_cast<int>(ProfileCounter::Count);
+
+// Everything recorded for one step.
+struct StepProfile
+{
+    double seconds[PHASE_COUNT];
+    long long counters[PROFILE_COUNTER_COUNT];
+};
+
+// steps the profiler keeps by default; at 60 steps a second that is the
+// last 18 minutes or so of a viewer session
+const size_t PROFILE_HISTORY = 1 << 16;
+
+// A static singleton that collects one StepProfile per simulation step.
+// Timers are meant for the thread that drives the step; counters may be
+// added from worker threads. Nothing here is called unless the physics is
+// compiled with NBODY_PROFILE, see the macros below.
+//
+// The history is a ring of at most Capacity() steps: once it is full each
+// new step drops the oldest, so a run that never clears it, like the
+// viewer, stays in bounded memory. Steps keep their numbers from the first
+// step recorded after the last Clear.
+class Profiler
+{
+public:
+    static void BeginStep();
+    static void EndStep();
+
+    static void AddTime(Phase phase, double seconds);
+    static void Add(ProfileCounter counter, long long amount);
+    static void Set(ProfileCounter counter, long long value);
+
+    // 0 keeps every step. Shrinking drops the oldest steps beyond it
+    static void SetCapacity(size_t capacity);
+    static size_t Capacity();
+
+    // steps held, and the i-th of them, oldest first
+    static size_t StepCount();
+    static const StepProfile& Step(size_t i);
+    // number of the oldest step held
+    static long long FirstStep();
+    static void Clear();
+
+    static const char* Name(Phase phase);
+    static const char* Name(ProfileCounter counter);
+
+    // one row / object per recorded step, times in milliseconds
+    static bool WriteCsv(const std::string& path);
+    static bool WriteJson(const std::string& path);
+
+private:
+    Profiler() { }
+
+    static std::vector<StepProfile> steps;
+    static size_t capacity;
+    // index in steps of the oldest step once the ring has wrapped
+    static size_t oldest;
+    static long long dropped;
+    static double current_seconds[PHASE_COUNT];
+    static std::atomic<long long> current_counters[PROFILE_COUNTER_COUNT];
+};
+
+// Adds the time between construction and destruction to a phase.
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(Phase phase);
+    ~ScopedTimer();
+
+private:
+    Phase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Marks the lifetime of one step: everything recorded in between is stored
+// as one StepProfile when it goes out of scope.
+class ScopedStep
+{
+public:
+    ScopedStep() { Profiler::BeginStep(); }
+    ~ScopedStep() { Profiler::EndStep(); }
+};
+
+#ifdef NBODY_PROFILE
+#define NBODY_PROFILE_CONCAT_INNER(a, b) a##b
+#define NBODY_PROFILE_CONCAT(a, b) NBODY_PROFILE_CONCAT_INNER(a, b)
+#define NBODY_PROFILE_STEP() ScopedStep NBODY_PROFILE_CONCAT(profile_step_, __LINE__)
+#define NBODY_PROFILE_SCOPE(phase) ScopedTimer NBODY_PROFILE_CONCAT(profile_timer_, __LINE__)(phase)
+#define NBODY_PROFILE_ADD(counter, amount) Profiler::Add(counter, amount)
+#define NBODY_PROFILE_SET(counter, value) Profiler::Set(counter, value)
+#else
+// sizeof keeps the arguments "used" without ever evaluating them
+#define NBODY_PROFILE_STEP() ((void)0)
+#define NBODY_PROFILE_SCOPE(phase) ((void)0)
+#define NBODY_PROFILE_ADD(counter, amount) ((void)sizeof(amount))
+#define NBODY_PROFILE_SET(counter, value) ((void)sizeof(value))
+#endif
@@ -0,0 +1,15 @@
+#version 330 core
+layout (location = 0) in vec4 vertex;   // <vec2 position, vec2 texCoords>, quad centered on the origin
+layout (location = 1) in vec4 instance; // <vec3 position, float size>, one per body
+
+out vec2 TexCoords;
+
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    TexCoords = vertex.zw;
+    vec3 world = instance.xyz + vec3(vertex.xy * instance.w, 0.0);
+    gl_Position = projection * view * vec4(world, 1.0);
+}
\ No newline at end of file
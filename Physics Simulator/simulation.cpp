@@ -0,0 +1,357 @@
+#include "simulation.h"
+
+#include "gravity.h"
+#include "profiler.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <math.h>
+
+// deepest block timestep bin; a body in bin b steps dt / 2^b
+const int MAX_TIMESTEP_BIN = 10;
+// accuracy parameter of both block timestep criteria
+const float TIMESTEP_ETA = 0.025f;
+
+// The longest dt_max / 2^bin below both sqrt(2 eta eps / |a|) and
+// eta |a| / |jerk|. The jerk is not known on the very first step, so 0
+// leaves that criterion out.
+static int TimestepBin(glm::vec3 acceleration, float jerk, float dt_max)
+{
+    float a = glm::length(acceleration);
+    float limit = dt_max;
+
+    if (a > 0.0f)
+    {
+        limit = std::min(limit, sqrt(2.0f * TIMESTEP_ETA * SOFTENING / a));
+    }
+    if (jerk > 0.0f)
+    {
+        limit = std::min(limit, TIMESTEP_ETA * a / jerk);
+    }
+
+    int bin = 0;
+    float step = dt_max;
+    while (bin < MAX_TIMESTEP_BIN && step > limit)
+    {
+        step *= 0.5f;
+        ++bin;
+    }
+    return bin;
+}
+
+Simulation::Simulation(int thread_count)
+    : Scheme(Integrator::Leapfrog)
+    , Threads(new ThreadPool(thread_count))
+    , ForcesValid(false)
+    , ForceCount(0)
+    , ForceUpdateCount(0)
+{
+    SetSolver("bh");
+}
+
+Simulation::~Simulation()
+{
+    // the solver may still use the pool when it goes
+    Solver.reset();
+    delete Threads;
+}
+
+int Simulation::ThreadCount() const
+{
+    return Threads->ThreadCount();
+}
+
+ThreadPool* Simulation::Pool() const
+{
+    return Threads;
+}
+
+bool Simulation::SetSolver(const std::string& name)
+{
+    std::unique_ptr<GravitySolver> solver = CreateGravitySolver(name, Threads);
+    if (!solver)
+    {
+        return false;
+    }
+
+    SetSolver(std::move(solver), name);
+    return true;
+}
+
+void Simulation::SetSolver(std::unique_ptr<GravitySolver> solver, const std::string& name)
+{
+    Solver = std::move(solver);
+    Name = name;
+    ForcesValid = false;
+}
+
+GravitySolver& Simulation::Gravity()
+{
+    return *Solver;
+}
+
+const std::string& Simulation::SolverName() const
+{
+    return Name;
+}
+
+void Simulation::Step(float dt)
+{
+    NBODY_PROFILE_STEP();
+
+    switch (Scheme)
+    {
+    case Integrator::Euler:
+        ComputeForces();
+        {
+            NBODY_PROFILE_SCOPE(Phase::Kick);
+            Particles.Kick(dt);
+        }
+        {
+            NBODY_PROFILE_SCOPE(Phase::Drift);
+            Particles.Drift(dt);
+        }
+        break;
+
+    case Integrator::LeapfrogDKD:
+        {
+            NBODY_PROFILE_SCOPE(Phase::Drift);
+            Particles.Drift(0.5f * dt);
+        }
+        ComputeForces();
+        {
+            NBODY_PROFILE_SCOPE(Phase::Kick);
+            Particles.Kick(dt);
+        }
+        {
+            NBODY_PROFILE_SCOPE(Phase::Drift);
+            Particles.Drift(0.5f * dt);
+        }
+        break;
+
+    case Integrator::Block:
+        StepBlock(dt);
+        break;
+
+    default:
+        // the closing kick of the last step left the accelerations for the
+        // current positions behind, so only the first step has to compute them
+        if (!ForcesValid || ForceCount != Particles.Size())
+        {
+            ComputeForces();
+        }
+        {
+            NBODY_PROFILE_SCOPE(Phase::Kick);
+            Particles.Kick(0.5f * dt);
+        }
+        {
+            NBODY_PROFILE_SCOPE(Phase::Drift);
+            Particles.Drift(dt);
+        }
+        ComputeForces();
+        {
+            NBODY_PROFILE_SCOPE(Phase::Kick);
+            Particles.Kick(0.5f * dt);
+        }
+        break;
+    }
+
+    // Euler and drift-kick-drift move the bodies after their last force
+    // evaluation, so there is nothing to carry into the next step
+    if (Scheme == Integrator::Euler || Scheme == Integrator::LeapfrogDKD)
+    {
+        ForcesValid = false;
+    }
+}
+
+void Simulation::ComputeForces()
+{
+    EvaluateForces(Particles.Acceleration());
+
+    ForcesValid = true;
+    ForceCount = Particles.Size();
+    ForceUpdateCount += static_cast<long long>(Particles.Size());
+
+    NBODY_PROFILE_ADD(ProfileCounter::ForceEvaluations, 1);
+    NBODY_PROFILE_ADD(ProfileCounter::ForceUpdates, static_cast<long long>(Particles.Size()));
+}
+
+void Simulation::ComputeForces(const std::vector<int>& targets)
+{
+    const int count = static_cast<int>(targets.size());
+
+    Solver->ComputeAccelerations(Particles, targets.data(), count, Particles.Acceleration());
+
+    ForceUpdateCount += count;
+    NBODY_PROFILE_ADD(ProfileCounter::ForceUpdates, static_cast<long long>(count));
+}
+
+void Simulation::InvalidateForces()
+{
+    ForcesValid = false;
+}
+
+void Simulation::EvaluateForces(AccelOut out)
+{
+    Solver->ComputeAccelerations(Particles, out);
+}
+
+EnergyReport Simulation::Energy()
+{
+    const size_t n = Particles.Size();
+
+    for (AlignedVector<float>* column : { &EnergyAx, &EnergyAy, &EnergyAz, &Potential })
+    {
+        column->resize(n);
+    }
+
+    EvaluateForces(AccelOut{ EnergyAx.data(), EnergyAy.data(), EnergyAz.data(), Potential.data() });
+
+    EnergyReport report{ 0.0, 0.0, 0.0 };
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        glm::vec3 v = Particles.Velocity(i);
+        report.kinetic += 0.5 * Particles.m[i] * glm::dot(v, v);
+        // every pair is in two bodies' potentials
+        report.potential += 0.5 * Particles.m[i] * Potential[i];
+    }
+    report.total = report.kinetic + report.potential;
+
+    return report;
+}
+
+long long Simulation::ForceUpdates() const
+{
+    return ForceUpdateCount;
+}
+
+void Simulation::StepBlock(float dt)
+{
+    const int n = static_cast<int>(Particles.Size());
+    const int ticks = 1 << MAX_TIMESTEP_BIN;
+    const float tick = dt / ticks;
+
+    float* vx = Particles.vx.data();
+    float* vy = Particles.vy.data();
+    float* vz = Particles.vz.data();
+    const float* ax = Particles.ax.data();
+    const float* ay = Particles.ay.data();
+    const float* az = Particles.az.data();
+
+    auto kick = [&](int i, float h)
+    {
+        vx[i] += ax[i] * h;
+        vy[i] += ay[i] * h;
+        vz[i] += az[i] * h;
+    };
+
+    // every step starts and ends with all bodies in sync, so a fresh start
+    // only needs accelerations and bins from the current positions
+    if (!ForcesValid || ForceCount != Particles.Size() || static_cast<int>(Bins.size()) != n)
+    {
+        ComputeForces();
+
+        Bins.resize(n);
+        for (int i = 0; i < n; ++i)
+        {
+            Bins[i] = TimestepBin(glm::vec3(ax[i], ay[i], az[i]), 0.0f, dt);
+        }
+    }
+
+    PreviousAcceleration.resize(n);
+
+    int occupied[MAX_TIMESTEP_BIN + 1] = {};
+
+    {
+        NBODY_PROFILE_SCOPE(Phase::Kick);
+
+        for (int i = 0; i < n; ++i)
+        {
+            kick(i, 0.5f * dt / (1 << Bins[i]));
+            ++occupied[Bins[i]];
+        }
+    }
+
+    // time is counted in ticks of the deepest bin; a body in bin b is due
+    // every ticks >> b ticks
+    int t = 0;
+    while (t < ticks)
+    {
+        int next = ticks;
+        for (int b = 0; b <= MAX_TIMESTEP_BIN; ++b)
+        {
+            if (occupied[b] > 0)
+            {
+                int period = ticks >> b;
+                next = std::min(next, (t / period + 1) * period);
+            }
+        }
+
+        {
+            NBODY_PROFILE_SCOPE(Phase::Drift);
+            Particles.Drift((next - t) * tick);
+        }
+        t = next;
+
+        // bodies due now, in the solver's spatial order when it has one,
+        // so that neighbours walk the tree together
+        const int* order = Solver->BodyOrder();
+
+        Active.clear();
+        for (int k = 0; k < n; ++k)
+        {
+            int i = order ? order[k] : k;
+            if (t % (ticks >> Bins[i]) == 0)
+            {
+                Active.push_back(i);
+                PreviousAcceleration[i] = glm::vec3(ax[i], ay[i], az[i]);
+            }
+        }
+
+        // at the end of the step everybody is due, and the tree for the
+        // next step gets built as a side effect
+        if (t == ticks)
+        {
+            ComputeForces();
+        }
+        else
+        {
+            ComputeForces(Active);
+        }
+
+        NBODY_PROFILE_SCOPE(Phase::Kick);
+
+        for (int i : Active)
+        {
+            int bin = Bins[i];
+            float step = dt / (1 << bin);
+            glm::vec3 a(ax[i], ay[i], az[i]);
+
+            kick(i, 0.5f * step);
+
+            float jerk = glm::length(a - PreviousAcceleration[i]) / step;
+            int wanted = TimestepBin(a, jerk, dt);
+
+            // a shorter step can start at any tick; a longer one only one
+            // level at a time and where that level's grid lines up
+            if (wanted > bin)
+            {
+                bin = wanted;
+            }
+            else if (wanted < bin && t % (ticks >> (bin - 1)) == 0)
+            {
+                bin = bin - 1;
+            }
+
+            --occupied[Bins[i]];
+            ++occupied[bin];
+            Bins[i] = bin;
+
+            if (t < ticks)
+            {
+                kick(i, 0.5f * dt / (1 << bin));
+            }
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "gravity.h"
+#include "gravity_solver.h"
+#include "particle_set.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// How a step advances positions and velocities from the accelerations.
+enum class Integrator
+{
+    // v += a dt, then x += v dt; first order, kept for comparison
+    Euler,
+    // kick-drift-kick leapfrog, which is the same update as velocity
+    // Verlet. Second order and symplectic; the force at the end of one
+    // step is reused as the force at the start of the next, so it costs
+    // one force evaluation per step like Euler does
+    Leapfrog,
+    // drift-kick-drift leapfrog: one force evaluation at the half step and
+    // nothing carried between steps
+    LeapfrogDKD,
+    // kick-drift-kick leapfrog with individual power-of-two timesteps: dt
+    // is the longest step, and each body takes dt / 2^bin with its bin
+    // picked from its acceleration and jerk. A substep only recomputes the
+    // forces on the bodies whose step ends there, against the tree from
+    // the start of the step with its mass summaries refreshed
+    Block
+};
+
+// Kinetic and potential energy of all bodies, for checking conservation.
+struct EnergyReport
+{
+    double kinetic;
+    double potential;
+    double total;
+};
+
+// Everything needed to advance the bodies, with no rendering attached, so
+// the same code drives both the viewer and the headless batch runs.
+class Simulation
+{
+public:
+    ParticleSet Particles;
+    Integrator Scheme;
+
+    // thread_count includes the calling thread; 0 uses every hardware
+    // thread. Starts with the bh solver
+    explicit Simulation(int thread_count = 0);
+    ~Simulation();
+
+    // picks the force calculation by its name in the solver registry (see
+    // gravity_solver.h); returns false and keeps the current one if there
+    // is no such solver
+    bool SetSolver(const std::string& name);
+    // the same with a solver made elsewhere, which should run on Pool()
+    void SetSolver(std::unique_ptr<GravitySolver> solver, const std::string& name);
+    GravitySolver& Gravity();
+    const std::string& SolverName() const;
+
+    void Step(float dt);
+
+    // stores the acceleration of every body in Particles.ax/ay/az
+    void ComputeForces();
+    // call after changing positions or masses outside of Step, so the next
+    // leapfrog step does not reuse accelerations from before the change
+    void InvalidateForces();
+
+    // Acceleration, and potential when out.phi is set, on every body from
+    // the current solver, written to caller-owned arrays of at least
+    // Particles.Size() entries. Particles is left untouched, so this can
+    // run between steps.
+    void EvaluateForces(AccelOut out);
+
+    // total energy, with the potential taken from the current solver
+    EnergyReport Energy();
+
+    // bodies given a new acceleration since construction, summed over
+    // every force evaluation; with block timesteps most substeps only
+    // touch a few of them
+    long long ForceUpdates() const;
+
+    int ThreadCount() const;
+    ThreadPool* Pool() const;
+
+private:
+    void StepBlock(float dt);
+    // forces on the listed bodies only, reusing what the last full
+    // evaluation built
+    void ComputeForces(const std::vector<int>& targets);
+
+    ThreadPool* Threads;
+    std::unique_ptr<GravitySolver> Solver;
+    std::string Name;
+
+    // whether the accelerations in Particles are from the current solver
+    // at the current positions
+    bool ForcesValid;
+    size_t ForceCount;
+    long long ForceUpdateCount;
+
+    // block timesteps: each body's bin, the bodies due on a substep, and
+    // the acceleration they had before it
+    std::vector<int> Bins;
+    std::vector<int> Active;
+    std::vector<glm::vec3> PreviousAcceleration;
+    // scratch results for Energy
+    AlignedVector<float> EnergyAx, EnergyAy, EnergyAz, Potential;
+};
@@ -0,0 +1,153 @@
+#include "snapshot_writer.h"
+
+#include <algorithm>
+#include <chrono>
+
+typedef std::chrono::steady_clock Clock;
+
+static double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+SnapshotWriter::SnapshotWriter(WriteFunction write, int queue_depth, bool drop_when_full)
+    : write(write)
+    , drop_when_full(drop_when_full)
+    , writing(false)
+    , stats()
+    , stopping(false)
+{
+    for (int i = 0; i < queue_depth; ++i)
+    {
+        frames.push_back(std::unique_ptr<Frame>(new Frame()));
+        free_frames.push_back(frames.back().get());
+    }
+
+    if (queue_depth > 0)
+    {
+        thread = std::thread(&SnapshotWriter::Run, this);
+    }
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (!thread.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+bool SnapshotWriter::Submit(const ParticleSet& particles, long long step, double time, unsigned int tag, const float* potential)
+{
+    if (frames.empty())
+    {
+        Clock::time_point start = Clock::now();
+        bool ok = write(particles, potential, step, time, tag);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.submitted;
+        ++(ok ? stats.written : stats.failed);
+        stats.write_seconds += SecondsSince(start);
+        return ok;
+    }
+
+    Frame* frame = nullptr;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++stats.submitted;
+
+        if (free_frames.empty())
+        {
+            if (drop_when_full)
+            {
+                ++stats.dropped;
+                return false;
+            }
+
+            Clock::time_point start = Clock::now();
+            changed.wait(lock, [this] { return !free_frames.empty(); });
+            stats.wait_seconds += SecondsSince(start);
+        }
+
+        frame = free_frames.back();
+        free_frames.pop_back();
+    }
+
+    // the copy runs without the lock, so the writer keeps going meanwhile.
+    // Assigning into a buffer that has held as many bodies before reuses
+    // its memory
+    Clock::time_point start = Clock::now();
+    frame->particles = particles;
+    frame->has_potential = potential != nullptr;
+    if (potential)
+    {
+        frame->potential.assign(potential, potential + particles.Size());
+    }
+    frame->step = step;
+    frame->time = time;
+    frame->tag = tag;
+    double copy_seconds = SecondsSince(start);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.copy_seconds += copy_seconds;
+        queued.push_back(frame);
+        stats.max_queued = std::max(stats.max_queued, static_cast<int>(queued.size()));
+    }
+    changed.notify_all();
+
+    return true;
+}
+
+void SnapshotWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return queued.empty() && !writing; });
+}
+
+SnapshotWriterStats SnapshotWriter::Stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void SnapshotWriter::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for (;;)
+    {
+        // whatever is queued when asked to stop still gets written
+        changed.wait(lock, [this] { return stopping || !queued.empty(); });
+        if (queued.empty())
+        {
+            return;
+        }
+
+        Frame* frame = queued.front();
+        queued.pop_front();
+        writing = true;
+
+        lock.unlock();
+        Clock::time_point start = Clock::now();
+        bool ok = write(frame->particles, frame->has_potential ? frame->potential.data() : nullptr,
+            frame->step, frame->time, frame->tag);
+        double write_seconds = SecondsSince(start);
+        lock.lock();
+
+        ++(ok ? stats.written : stats.failed);
+        stats.write_seconds += write_seconds;
+        free_frames.push_back(frame);
+        writing = false;
+
+        changed.notify_all();
+    }
+}
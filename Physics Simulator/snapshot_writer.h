@@ -0,0 +1,96 @@
+#pragma once
+
+#include "particle_set.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// What a SnapshotWriter has done since it was made. The step thread only
+// ever pays for copy_seconds and wait_seconds; wait_seconds and dropped
+// growing means the disk cannot keep up with the output cadence.
+struct SnapshotWriterStats
+{
+    long long submitted;
+    long long written;
+    long long dropped;
+    long long failed;
+    // most frames ever waiting for the writer at once
+    int max_queued;
+    // step thread: copying bodies out, and waiting for a free buffer
+    double copy_seconds;
+    double wait_seconds;
+    // writer thread: time spent in the write function
+    double write_seconds;
+};
+
+// Writes copies of the bodies on a thread of its own, so that output does
+// not hold up stepping. Submit copies the particle columns into one of
+// queue_depth buffers, which are reused so the copies do not allocate once
+// they have grown, and returns; the writer thread hands the buffers to the
+// write function in the order they were submitted.
+//
+// When every buffer is waiting to be written, Submit either waits for one
+// to come free or drops the frame, as chosen at construction.
+class SnapshotWriter
+{
+public:
+    // Does the actual writing, on the writer thread; returns false if it
+    // failed. potential is one value per body, or null if Submit was given
+    // none. tag is whatever was given to Submit, e.g. which outputs are due
+    // on this step.
+    typedef std::function<bool(const ParticleSet& particles, const float* potential, long long step, double time, unsigned int tag)> WriteFunction;
+
+    // queue_depth 0 writes on the calling thread from inside Submit, with
+    // no copy, for comparison and for callers that want no extra thread
+    SnapshotWriter(WriteFunction write, int queue_depth = 2, bool drop_when_full = false);
+    // writes everything still queued
+    ~SnapshotWriter();
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // Queues a copy of particles, and of potential (particles.Size()
+    // values) when given. Returns false if the frame was dropped, or when
+    // writing synchronously, if writing it failed.
+    bool Submit(const ParticleSet& particles, long long step, double time, unsigned int tag = 0, const float* potential = nullptr);
+
+    // waits until every submitted frame has been written
+    void Flush();
+
+    SnapshotWriterStats Stats() const;
+
+private:
+    struct Frame
+    {
+        ParticleSet particles;
+        AlignedVector<float> potential;
+        bool has_potential;
+        long long step;
+        double time;
+        unsigned int tag;
+    };
+
+    void Run();
+
+    WriteFunction write;
+    bool drop_when_full;
+
+    // every buffer; each is in exactly one of free_frames, queued, or
+    // owned by the thread copying into or writing from it
+    std::vector<std::unique_ptr<Frame>> frames;
+    std::vector<Frame*> free_frames;
+    std::deque<Frame*> queued;
+    bool writing;
+
+    SnapshotWriterStats stats;
+
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    bool stopping;
+    std::thread thread;
+};
@@ -0,0 +1,126 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int thread_count)
+    : job(nullptr)
+    , job_count(0)
+    , job_chunk(1)
+    , next_index(0)
+    , busy_workers(0)
+    , generation(0)
+    , stopping(false)
+{
+    if (thread_count <= 0)
+    {
+        thread_count = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    if (thread_count <= 0)
+    {
+        thread_count = 1;
+    }
+
+    // thread 0 is whoever calls ParallelFor
+    for (int i = 1; i < thread_count; ++i)
+    {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+int ThreadPool::ThreadCount() const
+{
+    return static_cast<int>(workers.size()) + 1;
+}
+
+void ThreadPool::ParallelFor(int count, int chunk, const std::function<void(int, int, int)>& body)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+
+    if (chunk < 1)
+    {
+        chunk = 1;
+    }
+
+    // not worth waking anybody up for a single chunk
+    if (workers.empty() || count <= chunk)
+    {
+        body(0, count, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &body;
+        job_count = count;
+        job_chunk = chunk;
+        next_index = 0;
+        busy_workers = static_cast<int>(workers.size());
+        ++generation;
+    }
+    wake.notify_all();
+
+    RunChunks(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return busy_workers == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::WorkerLoop(int thread)
+{
+    unsigned int seen = 0;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+
+            if (stopping)
+            {
+                return;
+            }
+            seen = generation;
+        }
+
+        RunChunks(thread);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy_workers == 0)
+            {
+                finished.notify_one();
+            }
+        }
+    }
+}
+
+void ThreadPool::RunChunks(int thread)
+{
+    while (true)
+    {
+        int begin = next_index.fetch_add(job_chunk);
+        if (begin >= job_count)
+        {
+            return;
+        }
+
+        int end = begin + job_chunk < job_count ? begin + job_chunk : job_count;
+        (*job)(begin, end, thread);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for data-parallel loops. ParallelFor hands
+// out chunks of the index range from a shared counter, so threads that land
+// on cheap chunks simply take more of them and nobody sits idle while a
+// dense region is still being processed. The calling thread works too.
+class ThreadPool
+{
+public:
+    // thread_count includes the calling thread; 0 uses every hardware thread
+    explicit ThreadPool(int thread_count = 0);
+    ~ThreadPool();
+
+    int ThreadCount() const;
+
+    // Calls body(begin, end, thread) over [0, count) in chunks of at most
+    // chunk indices and returns when all of them are done. thread is in
+    // [0, ThreadCount()) and is unique among concurrently running calls.
+    void ParallelFor(int count, int chunk, const std::function<void(int, int, int)>& body);
+
+private:
+    void WorkerLoop(int thread);
+    void RunChunks(int thread);
+
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    const std::function<void(int, int, int)>* job;
+    int job_count;
+    int job_chunk;
+    std::atomic<int> next_index;
+
+    int busy_workers;
+    unsigned int generation;
+    bool stopping;
+};
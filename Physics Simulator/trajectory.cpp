@@ -0,0 +1,820 @@
+#include "trajectory.h"
+
+#include "morton.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static_assert(sizeof(TrajectoryHeader) == 24, "TrajectoryHeader must not have padding");
+static_assert(sizeof(TrajectoryFrameHeader) == 88, "TrajectoryFrameHeader must not have padding");
+
+// values coded with one Rice parameter
+const size_t RICE_BLOCK = 256;
+const int RICE_PARAMETER_BITS = 5;
+// a quotient this large is written as this many one bits and then the
+// value in full, so one outlier cannot cost billions of bits
+const uint32_t RICE_ESCAPE = 32;
+
+// TrajectoryReader::decoded before anything has been decoded
+const size_t NO_FRAME_DECODED = static_cast<size_t>(-1);
+
+// Maps small differences of either sign to small unsigned values:
+// 0, -1, 1, -2, 2 ... become 0, 1, 2, 3, 4 ...
+static uint32_t ZigZag(int32_t value)
+{
+    return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+static int32_t UnZigZag(uint32_t value)
+{
+    return static_cast<int32_t>((value >> 1) ^ (0u - (value & 1)));
+}
+
+// Bits packed from the lowest bit of each byte up.
+class BitWriter
+{
+public:
+    BitWriter(std::vector<unsigned char>& out)
+        : out(out)
+        , buffer(0)
+        , count(0)
+    {
+    }
+
+    // value must fit in bits, at most 32
+    void Put(uint32_t value, int bits)
+    {
+        buffer |= static_cast<uint64_t>(value) << count;
+        count += bits;
+
+        while (count >= 8)
+        {
+            out.push_back(static_cast<unsigned char>(buffer));
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    void Finish()
+    {
+        if (count > 0)
+        {
+            out.push_back(static_cast<unsigned char>(buffer));
+        }
+        buffer = 0;
+        count = 0;
+    }
+
+private:
+    std::vector<unsigned char>& out;
+    uint64_t buffer;
+    int count;
+};
+
+class BitReader
+{
+public:
+    BitReader(const unsigned char* data, uint64_t bytes)
+        : data(data)
+        , end(data + bytes)
+        , buffer(0)
+        , count(0)
+        , available(bytes * 8)
+        , used(0)
+    {
+    }
+
+    // reading past the end gives zero bits; Overrun tells afterwards
+    uint32_t Take(int bits)
+    {
+        Refill();
+
+        uint32_t value = static_cast<uint32_t>(buffer & ((uint64_t(1) << bits) - 1));
+        Skip(bits);
+        return value;
+    }
+
+    // the number of one bits before the next zero bit, up to limit, with
+    // the zero consumed too
+    uint32_t Unary(uint32_t limit)
+    {
+        Refill();
+
+        uint32_t ones = 0;
+        while (ones < limit && (buffer >> ones & 1))
+        {
+            ++ones;
+        }
+
+        Skip(ones < limit ? ones + 1 : ones);
+        return ones;
+    }
+
+    bool Overrun() const
+    {
+        return used > available;
+    }
+
+private:
+    // tops the buffer up to at least 57 bits
+    void Refill()
+    {
+        while (count <= 56)
+        {
+            uint64_t byte = data < end ? *data++ : 0;
+            buffer |= byte << count;
+            count += 8;
+        }
+    }
+
+    void Skip(int bits)
+    {
+        buffer >>= bits;
+        count -= bits;
+        used += bits;
+    }
+
+    const unsigned char* data;
+    const unsigned char* end;
+    uint64_t buffer;
+    int count;
+    uint64_t available;
+    uint64_t used;
+};
+
+// bits it takes to Rice code values with parameter k
+static uint64_t RiceCost(const uint32_t* values, size_t count, int k)
+{
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t quotient = values[i] >> k;
+        bits += quotient < RICE_ESCAPE ? quotient + 1 + k : RICE_ESCAPE + 32;
+    }
+    return bits;
+}
+
+// Appends count values to out as Rice codes: each value's top bits in
+// unary and its low k bits as they are. Every block picks its own k, so
+// the code follows the values as they get larger or smaller along a frame.
+static void EncodeRice(const uint32_t* values, size_t count, std::vector<unsigned char>& out)
+{
+    BitWriter writer(out);
+
+    for (size_t begin = 0; begin < count; begin += RICE_BLOCK)
+    {
+        const uint32_t* block = values + begin;
+        const size_t n = std::min(RICE_BLOCK, count - begin);
+
+        // 2^k near the mean is close to the best k for differences, which
+        // fall off roughly geometrically; try it and its neighbours
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            sum += block[i];
+        }
+
+        int estimate = 0;
+        while (estimate < 31 && (static_cast<uint64_t>(n) << estimate) < sum)
+        {
+            ++estimate;
+        }
+
+        int k = estimate;
+        uint64_t best = RiceCost(block, n, k);
+        for (int candidate : { estimate - 1, estimate + 1 })
+        {
+            if (candidate < 0 || candidate > 31)
+            {
+                continue;
+            }
+            uint64_t cost = RiceCost(block, n, candidate);
+            if (cost < best)
+            {
+                best = cost;
+                k = candidate;
+            }
+        }
+
+        writer.Put(static_cast<uint32_t>(k), RICE_PARAMETER_BITS);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t quotient = block[i] >> k;
+
+            if (quotient < RICE_ESCAPE)
+            {
+                writer.Put((1u << quotient) - 1, quotient + 1);
+                if (k > 0)
+                {
+                    writer.Put(block[i] & ((1u << k) - 1), k);
+                }
+            }
+            else
+            {
+                writer.Put(0xffffffffu, RICE_ESCAPE);
+                writer.Put(block[i], 32);
+            }
+        }
+    }
+
+    writer.Finish();
+}
+
+// Reads count values written by EncodeRice; false if the data ran out.
+static bool DecodeRice(const unsigned char* data, uint64_t bytes, uint32_t* values, size_t count)
+{
+    BitReader reader(data, bytes);
+
+    for (size_t begin = 0; begin < count; begin += RICE_BLOCK)
+    {
+        const size_t n = std::min(RICE_BLOCK, count - begin);
+        const int k = static_cast<int>(reader.Take(RICE_PARAMETER_BITS));
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t quotient = reader.Unary(RICE_ESCAPE);
+
+            if (quotient < RICE_ESCAPE)
+            {
+                values[begin + i] = quotient << k | reader.Take(k);
+            }
+            else
+            {
+                values[begin + i] = reader.Take(32);
+            }
+        }
+
+        if (reader.Overrun())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint32_t GridLevels(int bits)
+{
+    return (1u << bits) - 1;
+}
+
+TrajectoryWriter::TrajectoryWriter()
+    : file(nullptr)
+    , frames(0)
+    , keyframes(0)
+    , since_keyframe(0)
+    , bytes(0)
+    , box_min()
+    , box_max()
+{
+}
+
+TrajectoryWriter::~TrajectoryWriter()
+{
+    std::string error;
+    Close(error);
+}
+
+bool TrajectoryWriter::Open(const std::string& path, const TrajectoryOptions& options, std::string& error)
+{
+    if (!Close(error))
+    {
+        return false;
+    }
+
+    if (options.bits < 4 || options.bits > 24)
+    {
+        error = "trajectory bits must be 4 to 24";
+        return false;
+    }
+
+    file = std::fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    this->path = path;
+    this->options = options;
+    this->options.keyframe_every = std::max(1, options.keyframe_every);
+    this->options.margin = std::max(0.0f, options.margin);
+    frames = 0;
+    keyframes = 0;
+    since_keyframe = 0;
+    order.clear();
+
+    TrajectoryHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_VERSION;
+    header.header_bytes = sizeof(TrajectoryHeader);
+    header.byte_order = TRAJECTORY_BYTE_ORDER;
+    header.bits = static_cast<uint32_t>(options.bits);
+
+    bytes = sizeof(header);
+    if (std::fwrite(&header, sizeof(header), 1, file) != 1 || std::fflush(file) != 0)
+    {
+        std::fclose(file);
+        file = nullptr;
+        error = "cannot write " + path;
+        return false;
+    }
+
+    return true;
+}
+
+bool TrajectoryWriter::Close(std::string& error)
+{
+    if (!file)
+    {
+        return true;
+    }
+
+    bool ok = std::fclose(file) == 0;
+    file = nullptr;
+
+    if (!ok)
+    {
+        error = "cannot write " + path;
+    }
+    return ok;
+}
+
+bool TrajectoryWriter::Append(const ParticleSet& particles, long long step, double time, std::string& error)
+{
+    if (!file)
+    {
+        error = "trajectory is not open";
+        return false;
+    }
+
+    // a body leaving the grid is only found by trying to put it on it
+    bool keyframe = since_keyframe == 0 || since_keyframe >= options.keyframe_every ||
+        particles.Size() != order.size() || !Quantize(particles);
+
+    // a grid fitted around the bodies holds every finite position, so
+    // only a NaN or infinite coordinate gets here
+    if (keyframe)
+    {
+        StartKeyframe(particles);
+        if (!Quantize(particles))
+        {
+            // the grid has changed under the previous frame, so whatever
+            // comes next has to be a keyframe
+            since_keyframe = 0;
+            error = "cannot write step " + std::to_string(step) + " to " + path + ": a position is not finite";
+            return false;
+        }
+    }
+
+    if (!WriteFrame(particles, step, time, keyframe, error))
+    {
+        return false;
+    }
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        previous[axis].swap(current[axis]);
+    }
+
+    ++frames;
+    keyframes += keyframe ? 1 : 0;
+    since_keyframe = keyframe ? 1 : since_keyframe + 1;
+    return true;
+}
+
+long long TrajectoryWriter::FramesWritten() const
+{
+    return frames;
+}
+
+long long TrajectoryWriter::KeyframesWritten() const
+{
+    return keyframes;
+}
+
+uint64_t TrajectoryWriter::BytesWritten() const
+{
+    return bytes;
+}
+
+// Puts every body on the grid in slot order; false as soon as one is off it.
+bool TrajectoryWriter::Quantize(const ParticleSet& particles)
+{
+    const size_t n = order.size();
+    const float levels = static_cast<float>(GridLevels(options.bits));
+
+    const float* coords[3] = { particles.x.data(), particles.y.data(), particles.z.data() };
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const float* c = coords[axis];
+        const float low = box_min[axis];
+        const float scale = levels / (box_max[axis] - box_min[axis]);
+
+        std::vector<uint32_t>& out = current[axis];
+        out.resize(n);
+
+        for (size_t s = 0; s < n; ++s)
+        {
+            float cell = (c[order[s]] - low) * scale + 0.5f;
+
+            // written so that NaN fails too
+            if (!(cell >= 0.0f && cell < levels + 1.0f))
+            {
+                return false;
+            }
+            out[s] = static_cast<uint32_t>(cell);
+        }
+    }
+
+    return true;
+}
+
+// Fits a new grid around the bodies and sorts them into Morton order on it.
+void TrajectoryWriter::StartKeyframe(const ParticleSet& particles)
+{
+    const size_t n = particles.Size();
+    const float* coords[3] = { particles.x.data(), particles.y.data(), particles.z.data() };
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float low = n > 0 ? coords[axis][0] : 0.0f;
+        float high = low;
+
+        for (size_t i = 1; i < n; ++i)
+        {
+            low = std::min(low, coords[axis][i]);
+            high = std::max(high, coords[axis][i]);
+        }
+
+        // a flat axis still needs a grid step that is not zero
+        float pad = std::max((high - low) * options.margin, 1e-3f * std::max(1.0f, std::abs(low)));
+        box_min[axis] = low - pad;
+        box_max[axis] = high + pad;
+    }
+
+    glm::vec3 corner(box_min[0], box_min[1], box_min[2]);
+    float length = std::max({ box_max[0] - box_min[0], box_max[1] - box_min[1], box_max[2] - box_min[2] });
+
+    keys.resize(n);
+    order.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        keys[i] = MortonKey(particles.Position(i), corner, length);
+        order[i] = static_cast<int>(i);
+    }
+
+    RadixSort(keys, order, key_scratch, index_scratch, count_scratch);
+}
+
+bool TrajectoryWriter::WriteFrame(const ParticleSet& particles, long long step, double time, bool keyframe, std::string& error)
+{
+    const size_t n = order.size();
+    values.resize(n);
+
+    for (std::vector<unsigned char>& stream : streams)
+    {
+        stream.clear();
+    }
+
+    if (keyframe)
+    {
+        uint32_t last = 0;
+        for (size_t s = 0; s < n; ++s)
+        {
+            uint32_t id = particles.id[order[s]];
+            values[s] = ZigZag(static_cast<int32_t>(id - last));
+            last = id;
+        }
+        EncodeRice(values.data(), n, streams[TRAJECTORY_IDS]);
+    }
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const std::vector<uint32_t>& now = current[axis];
+
+        // a keyframe differences along the Morton order, a delta frame
+        // against the same body one frame back
+        if (keyframe)
+        {
+            for (size_t s = 0; s < n; ++s)
+            {
+                values[s] = ZigZag(static_cast<int32_t>(now[s] - (s > 0 ? now[s - 1] : 0)));
+            }
+        }
+        else
+        {
+            const std::vector<uint32_t>& before = previous[axis];
+            for (size_t s = 0; s < n; ++s)
+            {
+                values[s] = ZigZag(static_cast<int32_t>(now[s] - before[s]));
+            }
+        }
+
+        EncodeRice(values.data(), n, streams[TRAJECTORY_X + axis]);
+    }
+
+    TrajectoryFrameHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.tag, TRAJECTORY_FRAME_TAG, sizeof(header.tag));
+    header.keyframe = keyframe ? 1 : 0;
+    header.step = static_cast<uint64_t>(step);
+    header.time = time;
+    header.count = n;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        header.box_min[axis] = box_min[axis];
+        header.box_max[axis] = box_max[axis];
+    }
+    for (int s = 0; s < TRAJECTORY_STREAMS; ++s)
+    {
+        header.stream_bytes[s] = streams[s].size();
+    }
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t written = sizeof(header);
+
+    for (const std::vector<unsigned char>& stream : streams)
+    {
+        ok = ok && (stream.empty() || std::fwrite(stream.data(), 1, stream.size(), file) == stream.size());
+        written += stream.size();
+    }
+
+    // a reader of a file that is still growing sees whole frames
+    ok = ok && std::fflush(file) == 0;
+
+    if (!ok)
+    {
+        error = "cannot write " + path;
+        return false;
+    }
+
+    bytes += written;
+    return true;
+}
+
+TrajectoryReader::TrajectoryReader()
+    : bits(0)
+    , decoded(NO_FRAME_DECODED)
+{
+}
+
+bool TrajectoryReader::Open(const std::string& path, std::string& error)
+{
+    Close();
+    this->path = path;
+
+    if (!file.Open(path))
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    const unsigned char* data = file.Data();
+    const uint64_t size = file.Size();
+
+    TrajectoryHeader header;
+    if (size < sizeof(header))
+    {
+        error = path + " is too short for a trajectory";
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0)
+    {
+        error = path + " is not a trajectory";
+        return false;
+    }
+    if (header.byte_order != TRAJECTORY_BYTE_ORDER)
+    {
+        error = path + " was written with the other byte order";
+        return false;
+    }
+    if (header.version == 0 || header.header_bytes < sizeof(header) || header.header_bytes > size ||
+        header.bits < 1 || header.bits > 31)
+    {
+        error = path + " has a broken header";
+        return false;
+    }
+    bits = static_cast<int>(header.bits);
+
+    uint64_t offset = header.header_bytes;
+
+    while (size - offset >= sizeof(TrajectoryFrameHeader))
+    {
+        TrajectoryFrameHeader frame;
+        std::memcpy(&frame, data + offset, sizeof(frame));
+
+        if (std::memcmp(frame.tag, TRAJECTORY_FRAME_TAG, sizeof(frame.tag)) != 0)
+        {
+            error = path + " has a broken frame " + std::to_string(frames.size());
+            Close();
+            return false;
+        }
+
+        uint64_t left = size - offset - sizeof(frame);
+        uint64_t payload = 0;
+        for (uint64_t stream : frame.stream_bytes)
+        {
+            payload += std::min(stream, left + 1);
+        }
+        if (payload > left)
+        {
+            // cut short while it was being written
+            break;
+        }
+
+        TrajectoryFrameInfo info;
+        info.step = frame.step;
+        info.time = frame.time;
+        info.count = frame.count;
+        info.keyframe = frame.keyframe != 0;
+        info.base = info.keyframe ? frames.size() : frames.empty() ? 0 : frames.back().base;
+        info.offset = static_cast<size_t>(offset);
+        std::memcpy(info.box_min, frame.box_min, sizeof(info.box_min));
+        std::memcpy(info.box_max, frame.box_max, sizeof(info.box_max));
+
+        if (!info.keyframe && (frames.empty() || frames[info.base].count != info.count))
+        {
+            error = path + " has a delta frame " + std::to_string(frames.size()) + " that does not fit its keyframe";
+            Close();
+            return false;
+        }
+
+        frames.push_back(info);
+        offset += sizeof(frame) + payload;
+    }
+
+    return true;
+}
+
+void TrajectoryReader::Close()
+{
+    file.Close();
+    frames.clear();
+    decoded = NO_FRAME_DECODED;
+}
+
+int TrajectoryReader::Bits() const
+{
+    return bits;
+}
+
+size_t TrajectoryReader::FrameCount() const
+{
+    return frames.size();
+}
+
+const TrajectoryFrameInfo& TrajectoryReader::Frame(size_t index) const
+{
+    return frames[index];
+}
+
+size_t TrajectoryReader::FindStep(uint64_t step) const
+{
+    auto later = std::upper_bound(frames.begin(), frames.end(), step,
+        [](uint64_t s, const TrajectoryFrameInfo& info) { return s < info.step; });
+
+    return later == frames.begin() ? 0 : static_cast<size_t>(later - frames.begin()) - 1;
+}
+
+bool TrajectoryReader::Read(size_t index, TrajectoryFrame& frame, std::string& error)
+{
+    if (index >= frames.size())
+    {
+        error = path + " has no frame " + std::to_string(index);
+        return false;
+    }
+
+    if (!Decode(index, error))
+    {
+        return false;
+    }
+
+    TrajectoryFrameHeader header;
+    std::memcpy(&header, file.Data() + frames[index].offset, sizeof(header));
+
+    const size_t n = static_cast<size_t>(header.count);
+    const float levels = static_cast<float>(GridLevels(bits));
+
+    frame.step = header.step;
+    frame.time = header.time;
+    frame.id = ids;
+
+    std::vector<float>* out[3] = { &frame.x, &frame.y, &frame.z };
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const float low = header.box_min[axis];
+        const float cell = (header.box_max[axis] - header.box_min[axis]) / levels;
+        const uint32_t* g = grid[axis].data();
+
+        std::vector<float>& c = *out[axis];
+        c.resize(n);
+        for (size_t s = 0; s < n; ++s)
+        {
+            c[s] = low + static_cast<float>(g[s]) * cell;
+        }
+    }
+
+    return true;
+}
+
+// Brings ids and grid to frame index, going on from the frame decoded last
+// when it is an earlier frame on the same keyframe.
+bool TrajectoryReader::Decode(size_t index, std::string& error)
+{
+    const TrajectoryFrameInfo& target = frames[index];
+
+    if (decoded == index)
+    {
+        return true;
+    }
+
+    size_t first = target.base;
+    if (decoded != NO_FRAME_DECODED && decoded < index && frames[decoded].base == target.base)
+    {
+        first = decoded + 1;
+    }
+
+    // left invalid until the whole run has decoded
+    decoded = NO_FRAME_DECODED;
+
+    for (size_t f = first; f <= index; ++f)
+    {
+        const TrajectoryFrameInfo& info = frames[f];
+        const size_t n = static_cast<size_t>(info.count);
+
+        TrajectoryFrameHeader header;
+        std::memcpy(&header, file.Data() + info.offset, sizeof(header));
+
+        const unsigned char* stream = file.Data() + info.offset + sizeof(header);
+        values.resize(n);
+
+        auto decode = [&](int which)
+        {
+            bool ok = DecodeRice(stream, header.stream_bytes[which], values.data(), n);
+            stream += header.stream_bytes[which];
+            if (!ok)
+            {
+                error = path + " has a broken frame " + std::to_string(f);
+            }
+            return ok;
+        };
+
+        if (info.keyframe)
+        {
+            if (!decode(TRAJECTORY_IDS))
+            {
+                return false;
+            }
+
+            ids.resize(n);
+            uint32_t last = 0;
+            for (size_t s = 0; s < n; ++s)
+            {
+                last += static_cast<uint32_t>(UnZigZag(values[s]));
+                ids[s] = last;
+            }
+        }
+        else
+        {
+            stream += header.stream_bytes[TRAJECTORY_IDS];
+        }
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (!decode(TRAJECTORY_X + axis))
+            {
+                return false;
+            }
+
+            std::vector<uint32_t>& g = grid[axis];
+            if (info.keyframe)
+            {
+                g.resize(n);
+                uint32_t last = 0;
+                for (size_t s = 0; s < n; ++s)
+                {
+                    last += static_cast<uint32_t>(UnZigZag(values[s]));
+                    g[s] = last;
+                }
+            }
+            else
+            {
+                for (size_t s = 0; s < n; ++s)
+                {
+                    g[s] += static_cast<uint32_t>(UnZigZag(values[s]));
+                }
+            }
+        }
+    }
+
+    decoded = index;
+    return true;
+}
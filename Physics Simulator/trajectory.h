@@ -0,0 +1,201 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "particle_set.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Compressed stream of body positions, for keeping many frames of a long
+// run. Positions are rounded to a grid over the bounding box, so the error
+// is at most half a grid step per axis, and stored as differences that are
+// small enough to entropy code into a few bits each.
+//
+// Layout, all little-endian:
+//     TrajectoryHeader
+//     frames, each a TrajectoryFrameHeader followed by its streams
+//
+// A keyframe sorts the bodies into Morton order over the grid, stores their
+// ids in that order, and codes each position as its difference from the
+// body before it, which is nearby. Delta frames after it keep the same
+// order and grid and code each position as its difference from the same
+// body in the frame before. Every stream is Rice coded in blocks, each with
+// the parameter that suits its values best.
+//
+// Frames are self-contained apart from their keyframe, so a reader can start
+// at any keyframe, and a file cut short by a crash loses only the frame that
+// was being written.
+const char TRAJECTORY_MAGIC[8] = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+const uint32_t TRAJECTORY_VERSION = 1;
+const uint32_t TRAJECTORY_BYTE_ORDER = 0x01020304;
+const char TRAJECTORY_FRAME_TAG[4] = { 'F', 'R', 'M', 'E' };
+
+// streams in a frame, in file order; delta frames have no ids
+enum TrajectoryStream
+{
+    TRAJECTORY_IDS,
+    TRAJECTORY_X,
+    TRAJECTORY_Y,
+    TRAJECTORY_Z,
+    TRAJECTORY_STREAMS
+};
+
+struct TrajectoryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint32_t byte_order;
+    // bits per axis of the grid
+    uint32_t bits;
+};
+
+struct TrajectoryFrameHeader
+{
+    char tag[4];
+    // 1 for a keyframe
+    uint32_t keyframe;
+    uint64_t step;
+    double time;
+    uint64_t count;
+    // the grid: 2^bits - 1 steps from box_min to box_max on each axis
+    float box_min[3];
+    float box_max[3];
+    uint64_t stream_bytes[TRAJECTORY_STREAMS];
+};
+
+struct TrajectoryOptions
+{
+    // bits per axis, 4 to 24; 16 keeps a 1000-unit box to within 0.008
+    int bits = 16;
+    // frames from one keyframe to the next; more frames between them
+    // compress better, fewer make seeking cheaper
+    int keyframe_every = 32;
+    // fraction of the box added on every side at a keyframe, so bodies can
+    // move for a while before one leaves the grid and forces a new keyframe
+    float margin = 0.125f;
+};
+
+// Appends frames to a trajectory file. Between keyframes the bodies must
+// stay in the same order in the ParticleSet, which Simulation keeps; a
+// change in their number starts a new keyframe.
+class TrajectoryWriter
+{
+public:
+    TrajectoryWriter();
+    ~TrajectoryWriter();
+
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+    // creates path, replacing any file there. On failure returns false with
+    // a message in error
+    bool Open(const std::string& path, const TrajectoryOptions& options, std::string& error);
+    bool Close(std::string& error);
+
+    // adds the bodies' positions as the next frame, flushed to the file
+    // before it returns. A NaN or infinite position fails with nothing
+    // written, and the frame after it starts a new keyframe
+    bool Append(const ParticleSet& particles, long long step, double time, std::string& error);
+
+    long long FramesWritten() const;
+    long long KeyframesWritten() const;
+    // everything written to the file so far, headers included
+    uint64_t BytesWritten() const;
+
+private:
+    bool Quantize(const ParticleSet& particles);
+    void StartKeyframe(const ParticleSet& particles);
+    bool WriteFrame(const ParticleSet& particles, long long step, double time, bool keyframe, std::string& error);
+
+    FILE* file;
+    std::string path;
+    TrajectoryOptions options;
+
+    long long frames;
+    long long keyframes;
+    int since_keyframe;
+    uint64_t bytes;
+
+    float box_min[3];
+    float box_max[3];
+    // body index in the ParticleSet of each slot, in Morton order
+    std::vector<int> order;
+    // grid coordinates of each slot in the frame before, and in this one
+    std::vector<uint32_t> previous[3];
+    std::vector<uint32_t> current[3];
+
+    std::vector<uint32_t> values;
+    std::vector<unsigned char> streams[TRAJECTORY_STREAMS];
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> key_scratch;
+    std::vector<int> index_scratch;
+    std::vector<size_t> count_scratch;
+};
+
+// Where a frame is and what it holds, without decoding it.
+struct TrajectoryFrameInfo
+{
+    uint64_t step;
+    double time;
+    uint64_t count;
+    bool keyframe;
+    // index of the keyframe this frame builds on, itself for a keyframe
+    size_t base;
+    size_t offset;
+    // the frame's grid, so a position read back is within half of
+    // (box_max - box_min) / (2^bits - 1) of where the body was
+    float box_min[3];
+    float box_max[3];
+};
+
+// One decoded frame, in the order of its keyframe's Morton sort; id says
+// which body each position belongs to.
+struct TrajectoryFrame
+{
+    uint64_t step;
+    double time;
+    std::vector<uint32_t> id;
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+};
+
+// Reads a trajectory file in place through a memory mapping. Open indexes
+// every frame from their headers alone; Read then decodes from the nearest
+// keyframe, or straight on from the frame read last when reading in order.
+class TrajectoryReader
+{
+public:
+    TrajectoryReader();
+
+    // an incomplete frame at the end of the file is left out. On failure
+    // returns false with a message in error
+    bool Open(const std::string& path, std::string& error);
+    void Close();
+
+    int Bits() const;
+    size_t FrameCount() const;
+    const TrajectoryFrameInfo& Frame(size_t index) const;
+    // the last frame at or before step, or the first frame if every frame
+    // is later
+    size_t FindStep(uint64_t step) const;
+
+    bool Read(size_t index, TrajectoryFrame& frame, std::string& error);
+
+private:
+    bool Decode(size_t index, std::string& error);
+
+    MappedFile file;
+    std::string path;
+    int bits;
+    std::vector<TrajectoryFrameInfo> frames;
+
+    // grid coordinates of the frame decoded last, and its index
+    size_t decoded;
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> grid[3];
+    std::vector<uint32_t> values;
+};